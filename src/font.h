@@ -3,7 +3,7 @@
 
 /* Generated by scripts in font_tools directory.  This shouldn't change, so it
  * isn't rebuilt every build. */
-const uint8_t font[40][5] = {
+const uint8_t font[40][5] PROGMEM = {
 	{0x00,0x78,0x84,0x78,0x00,},
 	{0x00,0x44,0xfc,0x04,0x00,},
 	{0x44,0x8c,0x94,0x64,0x00,},
@@ -0,0 +1,21 @@
+#ifndef HAL_H
+#define HAL_H
+
+/* Hardware abstraction layer.  main.c only touches the hardware through the
+ * functions declared here, which lets the same firmware be built either for
+ * the AVR (hal_avr.h) or as a host program running against simulated hardware
+ * and a mock VFD (host/hal_host.h).
+ *
+ * Both implementations also provide ISR(), cli() and sei() with their usual
+ * avr-libc meanings, and BOOT(), which starts the definition of a function
+ * that's run straight after reset, ahead of main(). */
+
+#define F_CPU 8000000UL
+
+#ifdef HOST
+#include "host/hal_host.h"
+#else
+#include "hal_avr.h"
+#endif
+
+#endif
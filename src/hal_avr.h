@@ -0,0 +1,580 @@
+#ifndef HAL_AVR_H
+#define HAL_AVR_H
+
+/* AVR implementation of the hardware abstraction layer in hal.h.  Everything
+ * here is static inline so that it compiles down to the same register
+ * accesses main.c used to make directly. */
+
+#include <stdint.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <util/delay.h>
+
+/* BOOT() { ... } is called from .init3, a few cycles after reset, once the
+ * stack is set up but before the variables are initialized, so it may only
+ * use the hardware, EEPROM and constant data.  It's a function of its own
+ * because a naked init section function can't safely have much in it. */
+#define BOOT() \
+	static void firmware_boot(void) __attribute__((noinline)); \
+	static void __attribute__((naked, used, section(".init3"))) \
+	hal_boot(void) \
+	{ \
+		firmware_boot(); \
+	} \
+	static void \
+	firmware_boot(void)
+
+/* Nothing to do while polling on the AVR.  The host build uses this to let
+ * simulated time pass. */
+static inline void
+hal_idle(void)
+{
+}
+
+static inline void
+hal_sleep(void)
+{
+	/* Called with interrupts disabled.  Enable them and sleep until the
+	 * next one; the instruction after sei always runs first, so an
+	 * interrupt can't slip in between the caller's checks and sleeping. */
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_enable();
+	sei();
+	sleep_cpu();
+	sleep_disable();
+}
+
+static inline void
+hal_clock_init(void)
+{
+	/* Enable writes to clock prescalar. */
+	CLKPR = _BV(CLKPCE);
+	/* Set clock prescalar division factor to 1. */
+	CLKPR = 0;
+}
+
+/* _delay_ms() and _delay_us() need compile-time constants. */
+#define hal_delay_ms(ms) _delay_ms(ms)
+#define hal_delay_us(us) _delay_us(us)
+
+
+/* Multiplexer banks.  Each board has its own five address lines, on PA4:PA0
+ * for the first, PF4:PF0 for the second and PC7:PC3 for the third (the
+ * ATmega2561 has no port K), and an active-high enable on PG0, PG1 and PG2
+ * respectively.  Only the pins of the banks in use are touched, so a
+ * single bank board keeps PF7:PF4 for its JTAG header.
+ *
+ * The first board predates the enables and ignores its one, so with more
+ * than one bank its outputs are always driven, and mux_write() keeps it on
+ * UNUSED_INPUT, which nothing is plugged into, while another bank is
+ * selected.  With just the one bank there's nothing to isolate it from, and
+ * no enables are driven at all.
+ *
+ * PF4 is also JTAG's TCK, with TMS, TDO and TDI on PF7:PF5, so JTAG is turned
+ * off when the second bank is in use, for it to have all its address
+ * lines. */
+
+#define HAL_MUX_BANKS 3
+
+static inline void
+hal_mux_init(uint8_t banks)
+{
+	/* Set the address pins of the banks with bits set in banks to
+	 * outputs, and their enables too if there's more than one, with every
+	 * bank disabled.  JTD only takes if it's written twice within four
+	 * cycles, so the value is worked out beforehand for back to back
+	 * writes.  This runs with interrupts off. */
+	uint8_t mcucr = MCUCR | _BV(JTD);
+
+	if (banks & 0x01)
+		DDRA = 0x1f;
+	if (banks & 0x02) {
+		MCUCR = mcucr;
+		MCUCR = mcucr;
+		DDRF |= 0x1f;
+	}
+	if (banks & 0x04)
+		DDRC |= 0xf8;
+	if (banks & (banks - 1)) {
+		PORTG &= ~(banks & 0x07);
+		DDRG |= banks & 0x07;
+	}
+}
+
+static inline void
+hal_mux_write(uint8_t bank, uint8_t address)
+{
+	switch (bank) {
+	case 0:
+		PORTA = address;
+		break;
+	case 1:
+		PORTF = address;
+		break;
+	case 2:
+		PORTC = (PORTC & 0x07) | (address << 3);
+		break;
+	}
+}
+
+static inline void
+hal_mux_enable(uint8_t banks)
+{
+	/* Enable the banks with bits set in banks, and disable the rest.
+	 * Enables that hal_mux_init() didn't make outputs are left alone. */
+	PORTG = (PORTG & ~(DDRG & 0x07)) | (banks & DDRG & 0x07);
+}
+
+
+/* VFD on the SPI bus, with reset on PC1 and busy on PC0. */
+
+static inline void
+hal_spi_init(void)
+{
+	/* Set /SS, SCK, and MOSI to output. */
+	DDRB |= (1 << PB2) | (1 << PB1) | (1 << PB0);
+	/* The AVR SPI system will not drive /SS when it is
+	 * set as an output, so set it here in order to select
+	 * the device. */
+	PORTB &= ~(1 << PB0);
+
+	/* Enable SPI master mode, double speed, transfer complete
+	 * interrupt. */
+	SPCR = (1 << SPIE) | (1 << SPE) | (1 << MSTR) | (1 << SPI2X);
+}
+
+static inline void
+hal_spi_write(uint8_t data)
+{
+	SPDR = data;
+}
+
+static inline void
+hal_vfd_reset_init(void)
+{
+	/* Set the VFD reset pin to output. */
+	DDRC |= (1 << PC1);
+}
+
+static inline void
+hal_vfd_reset(uint8_t high)
+{
+	if (high)
+		PORTC |= (1 << PC1);
+	else
+		PORTC &= ~(1 << PC1);
+}
+
+static inline uint8_t
+hal_vfd_busy(void)
+{
+	return PINC & (1 << PC0);
+}
+
+static inline void
+hal_vfd_retry_init(void)
+{
+	/* Timer 0 is used to retry transmission while the VFD is busy.  CTC,
+	 * CLK / 8, so with the 8 MHz clock OCR0A is in microseconds.  The
+	 * interrupt is only enabled while waiting. */
+	TCCR0A = _BV(WGM01);
+	TCCR0B = _BV(CS01);
+}
+
+static inline void
+hal_vfd_retry_arm(uint8_t us)
+{
+	/* Interrupt in us microseconds, from 1 to 255. */
+	OCR0A = us;
+	TCNT0 = 0;
+	TIFR0 = _BV(OCF0A);
+	TIMSK0 |= _BV(OCIE0A);
+}
+
+static inline void
+hal_vfd_retry_disarm(void)
+{
+	TIMSK0 &= ~_BV(OCIE0A);
+}
+
+
+/* Rotary encoder on PD1:PD0, which are also INT1:INT0. */
+
+/* Shortcuts for setting interrupt trigger conditions in EICRA. */
+#define ENC_INT_1_ANY (1 << ISC10)
+#define ENC_INT_0_ANY (1 << ISC00)
+
+static inline void
+hal_encoder_init(void)
+{
+	/* Configure PD0 and PD1 as inputs */
+	DDRD &= ~(1 << PD0);
+	DDRD &= ~(1 << PD1);
+
+	/* Enable the pull-up resistors */
+	PORTD |= (1 << PD0) | (1 << PD1);
+}
+
+static inline uint8_t
+hal_encoder_read(void)
+{
+	return PIND & 0x03;
+}
+
+static inline void
+hal_encoder_arm(uint8_t triggers)
+{
+	/* Set the ENC_INT_* trigger conditions and enable both encoder
+	 * interrupts. */
+	EICRA = triggers;
+	/* Clear interrupt flags. */
+	EIFR |= (1 << INTF1) | (1 << INTF0);
+	/* Enable interrupts on both encoder pins. */
+	EIMSK |= (1 << INT0) | (1 << INT1);
+}
+
+
+/* Timers.  Timer 1 is a free-running tick counter, with compare A and B
+ * interrupts for deadlines and frame pacing and compare C for input
+ * switching.  Timer 3 is another, at the same rate, with compare A
+ * interrupting once a second, and compare B and the input capture timing
+ * HDMI-CEC. */
+
+static inline void
+hal_ticks_init(void)
+{
+	TCCR1A = 0;
+	TCCR1B = _BV(CS12); /* CLK / 256*/
+	TCNT1 = 0;
+}
+
+static inline uint16_t
+hal_ticks(void)
+{
+	return TCNT1;
+}
+
+static inline void
+hal_deadline_arm(uint16_t at)
+{
+	/* Interrupt when TCNT1 reaches at. */
+	OCR1A = at;
+	TIFR1 = _BV(OCF1A);
+	TIMSK1 |= _BV(OCIE1A);
+}
+
+static inline void
+hal_deadline_disarm(void)
+{
+	TIMSK1 &= ~_BV(OCIE1A);
+}
+
+static inline void
+hal_frame_arm(uint16_t at)
+{
+	OCR1B = at;
+	TIFR1 = _BV(OCF1B);
+	TIMSK1 |= _BV(OCIE1B);
+}
+
+static inline void
+hal_frame_disarm(void)
+{
+	TIMSK1 &= ~_BV(OCIE1B);
+}
+
+static inline void
+hal_switch_arm(uint16_t at)
+{
+	OCR1C = at;
+	TIFR1 = _BV(OCF1C);
+	TIMSK1 |= _BV(OCIE1C);
+}
+
+static inline void
+hal_switch_disarm(void)
+{
+	TIMSK1 &= ~_BV(OCIE1C);
+}
+
+static inline void
+hal_seconds_init(void)
+{
+	/* Fire an interrupt every 1 second.  The timer runs freely for CEC, so
+	 * each interrupt moves the compare on by a second with
+	 * hal_seconds_next(). */
+	TCCR3A = 0;
+	TCCR3B = _BV(CS32); /* CLK / 256*/
+	TCNT3 = 0;
+	/* Timer compare interrupt */
+	OCR3A = 31250;
+	TIMSK3 |= 1 << OCIE3A;
+}
+
+static inline void
+hal_seconds_next(void)
+{
+	OCR3A += 31250;
+}
+
+
+/* HDMI-CEC on PE7, which is also ICP3.  The line is open drain with its own
+ * pull-up, so it's pulled low by making the pin an output, with PORTE7 left
+ * low, and released by making it an input again. */
+
+static inline void
+hal_cec_init(void)
+{
+	/* Release the line, and turn on the capture's noise canceller.  Must
+	 * come after hal_seconds_init(), which sets TCCR3B. */
+	DDRE &= ~(1 << PE7);
+	PORTE &= ~(1 << PE7);
+	TCCR3B |= _BV(ICNC3);
+}
+
+static inline uint16_t
+hal_cec_ticks(void)
+{
+	return TCNT3;
+}
+
+static inline void
+hal_cec_drive(uint8_t low)
+{
+	if (low)
+		DDRE |= (1 << PE7);
+	else
+		DDRE &= ~(1 << PE7);
+}
+
+static inline uint8_t
+hal_cec_line(void)
+{
+	/* Non-zero while the line is high. */
+	return PINE & (1 << PE7);
+}
+
+static inline void
+hal_cec_capture(uint8_t rising)
+{
+	/* Interrupt on the next rising or falling edge.  Changing the edge
+	 * can set the flag, so it's cleared afterwards. */
+	if (rising)
+		TCCR3B |= _BV(ICES3);
+	else
+		TCCR3B &= ~_BV(ICES3);
+	TIFR3 = _BV(ICF3);
+	TIMSK3 |= _BV(ICIE3);
+}
+
+static inline void
+hal_cec_capture_off(void)
+{
+	TIMSK3 &= ~_BV(ICIE3);
+}
+
+static inline uint16_t
+hal_cec_captured(void)
+{
+	/* TCNT3 when the edge came. */
+	return ICR3;
+}
+
+static inline void
+hal_cec_arm(uint16_t at)
+{
+	/* Interrupt when TCNT3 reaches at. */
+	OCR3B = at;
+	TIFR3 = _BV(OCF3B);
+	TIMSK3 |= _BV(OCIE3B);
+}
+
+static inline void
+hal_cec_disarm(void)
+{
+	TIMSK3 &= ~_BV(OCIE3B);
+}
+
+
+/* Profiling.  Timer 2, the one timer left over, counts at CLK / 128 and
+ * interrupts on overflow, every 4 ms, for its count to be extended. */
+
+static inline void
+hal_prof_init(void)
+{
+	TCCR2A = 0;
+	TCCR2B = _BV(CS22) | _BV(CS20); /* CLK / 128 */
+	TCNT2 = 0;
+	TIFR2 = _BV(TOV2);
+	TIMSK2 = _BV(TOIE2);
+}
+
+static inline uint8_t
+hal_prof_count(void)
+{
+	return TCNT2;
+}
+
+static inline uint8_t
+hal_prof_overflow(void)
+{
+	/* Whether an overflow is waiting for its interrupt. */
+	return TIFR2 & _BV(TOV2);
+}
+
+/* The stack's high-water mark.  SRAM between the end of the variables and
+ * the top of the stack is painted before main() runs, and the stack has
+ * overwritten however much of it it has ever grown into.  Painting takes
+ * tens of thousands of cycles, so it's left until .init5, after BOOT(). */
+#define HAL_STACK_PAINT 0xc5
+
+extern uint8_t _end;
+extern uint8_t __stack;
+
+static void __attribute__((naked, used, section(".init5")))
+hal_stack_paint(void)
+{
+	uint8_t *p = &_end;
+
+	while (p < (uint8_t *)SP)
+		*p++ = HAL_STACK_PAINT;
+}
+
+static inline uint16_t
+hal_stack_used(void)
+{
+	/* Bytes of stack ever used.  Scans up from the bottom, so it takes a
+	 * while. */
+	const uint8_t *p = &_end;
+
+	while ((p <= &__stack) && (*p == HAL_STACK_PAINT))
+		p++;
+	return &__stack + 1 - p;
+}
+
+
+/* Vertical sync from an LM1881 sync separator on the multiplexers' video
+ * output, active low into ICP1 (PD4), and the audio mute on PC2, high to
+ * mute. */
+
+static inline void
+hal_vsync_init(void)
+{
+	/* Input with the pull-up, so that without the sync separator there
+	 * are no edges.  Capture on the falling edge, with the noise
+	 * canceller.  Must come after hal_ticks_init(), which sets TCCR1B. */
+	DDRD &= ~(1 << PD4);
+	PORTD |= (1 << PD4);
+	TCCR1B = (TCCR1B & ~_BV(ICES1)) | _BV(ICNC1);
+}
+
+static inline void
+hal_vsync_arm(void)
+{
+	/* Interrupt on the next vertical sync. */
+	TIFR1 = _BV(ICF1);
+	TIMSK1 |= _BV(ICIE1);
+}
+
+static inline void
+hal_vsync_disarm(void)
+{
+	TIMSK1 &= ~_BV(ICIE1);
+}
+
+static inline void
+hal_audio_init(void)
+{
+	PORTC &= ~(1 << PC2);
+	DDRC |= (1 << PC2);
+}
+
+static inline void
+hal_audio_mute(uint8_t mute)
+{
+	if (mute)
+		PORTC |= (1 << PC2);
+	else
+		PORTC &= ~(1 << PC2);
+}
+
+
+/* Timing markers, which only the host build uses. */
+
+static inline void
+hal_mark(uint8_t id)
+{
+}
+
+
+/* EEPROM, addressed by byte offset. */
+
+static inline uint8_t
+hal_eeprom_read_byte(uint16_t addr)
+{
+	return eeprom_read_byte((const uint8_t *)addr);
+}
+
+static inline uint16_t
+hal_eeprom_read_word(uint16_t addr)
+{
+	return eeprom_read_word((const uint16_t *)addr);
+}
+
+static inline void
+hal_eeprom_read_block(void *dst, uint16_t addr, uint16_t len)
+{
+	eeprom_read_block(dst, (const void *)addr, len);
+}
+
+static inline void
+hal_eeprom_write_start(uint16_t addr, uint8_t value)
+{
+	/* Start writing a byte, which takes about 3.3 ms.  The EEPROM must be
+	 * ready, and interrupts must be disabled since EEPE has to be set
+	 * within four cycles of EEMPE. */
+	EEAR = addr;
+	EEDR = value;
+	EECR |= _BV(EEMPE);
+	EECR |= _BV(EEPE);
+}
+
+static inline void
+hal_eeprom_ready_irq(uint8_t enable)
+{
+	/* Enable or disable the EE_READY interrupt, which fires for as long as
+	 * the EEPROM isn't busy writing. */
+	if (enable)
+		EECR |= _BV(EERIE);
+	else
+		EECR &= ~_BV(EERIE);
+}
+
+
+/* Supply monitor.  The unregulated supply ahead of the 5 V regulator is
+ * divided down onto AIN1 (PE3) and compared against the 1.1 V bandgap, so
+ * the analog comparator output goes high when the supply sags below the
+ * trip point. */
+
+static inline void
+hal_power_init(void)
+{
+	/* Interrupt on the output rising.  ACIE has to be off while the mode
+	 * is changed, and the flag may have been set by doing so. */
+	DIDR1 = _BV(AIN1D);
+	ACSR = _BV(ACBG) | _BV(ACIS1) | _BV(ACIS0);
+	ACSR |= _BV(ACI);
+	ACSR |= _BV(ACIE);
+}
+
+static inline uint8_t
+hal_power_low(void)
+{
+	return ACSR & _BV(ACO);
+}
+
+#endif
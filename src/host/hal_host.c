@@ -0,0 +1,1410 @@
+/* Host implementation of the hardware abstraction layer, for running the
+ * firmware on a workstation.
+ *
+ * Time is simulated in CPU cycles at F_CPU.  The firmware only lets time pass
+ * when it calls hal_idle() (or waits in a delay or on the EEPROM), and that's
+ * also the only place interrupts are run.  Everything else runs at native
+ * speed, which makes this useful for profiling the rendering code and for
+ * regression-testing what ends up on the VFD.
+ *
+ * The mock VFD decodes the command stream sent over SPI, and renders bit
+ * image writes (0x1f 0x28 0x64 0x21) into a framebuffer that can be saved as
+ * PGM images.  A simulated HDMI-CEC bus carries frames from other devices to
+ * the firmware and decodes whatever it sends. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../hal.h"
+#include "../display.h"
+#include "marks.h"
+
+/* This file provides the real main(). */
+#undef main
+
+#define NEVER UINT64_MAX
+
+/* Simulated time in CPU cycles since reset. */
+static uint64_t now = 0;
+/* Stop after this many cycles. */
+static uint64_t run_cycles = 10 * F_CPU;
+/* Cycles that pass on each call to hal_idle(). */
+static uint64_t idle_cycles = 2000;
+/* Cycles spent asleep in hal_sleep(). */
+static uint64_t sleep_cycles = 0;
+
+
+/* Command line options. */
+static const char *out_path = NULL;
+static const char *dump_dir = NULL;
+static const char *eeprom_path = NULL;
+
+
+/* Mock VFD.  Display memory is modelled along with the display area that
+ * shows part of it, starting at a byte offset moved by the scroll command.
+ * Character display isn't.  The geometry is the same display.h profile the
+ * firmware is built for. */
+
+#define VFD_WIDTH DISPLAY_WIDTH
+#define VFD_HEIGHT DISPLAY_HEIGHT
+#define VFD_MEMORY_WIDTH DISPLAY_MEMORY_WIDTH
+#define VFD_MEMORY_SIZE (VFD_MEMORY_WIDTH * VFD_HEIGHT / 8)
+/* Cycles to shift a byte out at F_CPU / 2. */
+#define SPI_BYTE_CYCLES 16
+/* The VFD holds busy high for a while after reset. */
+#define VFD_RESET_BUSY_CYCLES (F_CPU / 1000)
+
+static struct {
+	uint8_t mem[VFD_MEMORY_SIZE];
+	/* Offset in mem of the top of the display's first column. */
+	uint16_t start;
+	uint8_t brightness;
+	uint8_t power;
+	/* Command being received. */
+	uint8_t cmd[13];
+	uint8_t cmd_len;
+	/* Bit image data still to come for the current command. */
+	uint16_t left, top, width, height;
+	uint32_t data_len, data_pos;
+	/* Statistics. */
+	uint64_t bytes, images, image_bytes, scrolls;
+	uint64_t first_image_at;
+} vfd;
+
+static uint64_t spi_at = NEVER;
+static uint64_t retry_at = NEVER;
+static uint32_t retry_cycles = 64;
+/* Busy retry interrupts, and a rough count of the cycles they take from the
+ * main loop: saving and restoring the call-clobbered registers around
+ * vfd_tx_next() and polling the busy pin. */
+#define RETRY_ISR_CYCLES 100
+static uint64_t retries = 0;
+static uint64_t busy_until = 0;
+/* Extra cycles the VFD stays busy after each byte, about 10 us. */
+static uint32_t busy_cycles = 80;
+static uint8_t reset_level = 1;
+
+static void
+vfd_save(const char *path)
+{
+	/* Save the VFD framebuffer as a binary PGM, lit pixels white. */
+	FILE *f;
+	int x, y;
+
+	f = fopen(path, "wb");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	fprintf(f, "P5\n%d %d\n255\n", VFD_WIDTH, VFD_HEIGHT);
+	for (y = 0; y < VFD_HEIGHT; y++) {
+		for (x = 0; x < VFD_WIDTH; x++) {
+			uint8_t b = vfd.mem[(vfd.start + x * (VFD_HEIGHT / 8)
+			                     + y / 8) % VFD_MEMORY_SIZE];
+			fputc((b & (0x80 >> (y % 8))) ? 255 : 0, f);
+		}
+	}
+	fclose(f);
+}
+
+static void
+vfd_dump(void)
+{
+	/* Save the display to the next frame file if dumping frames. */
+	char path[1024];
+
+	if (!dump_dir)
+		return;
+	snprintf(path, sizeof(path), "%s/frame%06lu.pgm", dump_dir,
+	         (unsigned long)(vfd.images + vfd.scrolls));
+	vfd_save(path);
+}
+
+static void
+vfd_image_byte(uint8_t data)
+{
+	/* Store a byte of bit image data.  Data is column-major, each byte is
+	 * 8 consecutive vertical pixels, just like the firmware's buffers. */
+	uint16_t rows = vfd.height / 8;
+	uint16_t x = vfd.left + vfd.data_pos / rows;
+	uint16_t y = vfd.top / 8 + vfd.data_pos % rows;
+
+	if ((x < VFD_MEMORY_WIDTH) && (y < VFD_HEIGHT / 8))
+		vfd.mem[x * (VFD_HEIGHT / 8) + y] = data;
+
+	if (++vfd.data_pos == vfd.data_len) {
+		if (!vfd.images++)
+			vfd.first_image_at = now;
+		vfd_dump();
+	}
+}
+
+static void
+vfd_receive(uint8_t data)
+{
+	vfd.bytes++;
+
+	if (vfd.data_pos < vfd.data_len) {
+		vfd.image_bytes++;
+		vfd_image_byte(data);
+		return;
+	}
+
+	if ((vfd.cmd_len == 0) && (data != 0x1f))
+		return; /* Character data, which isn't modelled. */
+
+	vfd.cmd[vfd.cmd_len++] = data;
+
+	if ((vfd.cmd_len == 3) && (vfd.cmd[1] == 0x58)) {
+		vfd.brightness = vfd.cmd[2];
+		vfd.cmd_len = 0;
+	}
+	else if ((vfd.cmd_len == 2) && (vfd.cmd[1] != 0x58)
+	         && (vfd.cmd[1] != 0x28)) {
+		vfd.cmd_len = 0;
+	}
+	else if ((vfd.cmd_len >= 4) && (vfd.cmd[2] == 0x61)) {
+		/* Display power, with one more byte after 0x40, or scroll,
+		 * with five more after 0x10: the shift in bytes and the
+		 * repeat count, both 16 bits, and the speed. */
+		if (vfd.cmd[3] == 0x40) {
+			if (vfd.cmd_len == 5) {
+				vfd.power = vfd.cmd[4];
+				vfd.cmd_len = 0;
+			}
+		}
+		else if (vfd.cmd[3] == 0x10) {
+			if (vfd.cmd_len == 9) {
+				vfd.start = (vfd.start
+				             + (uint32_t)(vfd.cmd[4]
+				                          | (vfd.cmd[5] << 8))
+				               * (vfd.cmd[6] | (vfd.cmd[7] << 8)))
+				            % VFD_MEMORY_SIZE;
+				vfd.scrolls++;
+				vfd.cmd_len = 0;
+				vfd_dump();
+			}
+		}
+		else {
+			vfd.cmd_len = 0;
+		}
+	}
+	else if ((vfd.cmd_len == 4) && ((vfd.cmd[2] != 0x64)
+	                                || (vfd.cmd[3] != 0x21))) {
+		vfd.cmd_len = 0;
+	}
+	else if (vfd.cmd_len == 13) {
+		vfd.left = vfd.cmd[4] | (vfd.cmd[5] << 8);
+		vfd.top = vfd.cmd[6] | (vfd.cmd[7] << 8);
+		vfd.width = vfd.cmd[8] | (vfd.cmd[9] << 8);
+		vfd.height = vfd.cmd[10] | (vfd.cmd[11] << 8);
+		vfd.data_len = (uint32_t)vfd.width * vfd.height / 8;
+		vfd.data_pos = 0;
+		vfd.cmd_len = 0;
+	}
+}
+
+
+/* Rotary encoder.  Spins requested on the command line, and traces replayed
+ * with -T, are turned into a list of pin changes.  A trace is a text file with
+ * a line for each change,
+ *
+ *	TIME PINS
+ *
+ * TIME in milliseconds from reset and PINS the new PD1 and PD0 levels as two
+ * binary digits.  Besides comments starting with #, a trace can have lines
+ *
+ *	expect pos COLUMN
+ *	expect input BANK:ADDRESS
+ *	expect latency MS
+ *
+ * with the ribbon position that should have been saved by the end of the
+ * run, the input that should have been switched to, or "none", and the most
+ * milliseconds any step should take to reach the VFD.  See host/traces/. */
+
+#define MAX_ENC_EDGES 65536
+/* Cycles between edges of a simulated spin. */
+static uint32_t enc_edge_cycles = F_CPU / 500;
+
+static struct {
+	uint64_t at;
+	uint8_t pins;
+} enc_edges[MAX_ENC_EDGES];
+static unsigned enc_nedges = 0, enc_next = 0;
+static uint8_t enc_pins = 0;
+static uint8_t enc_triggers = 0;
+static uint8_t enc_enabled = 0;
+/* PD1:PD0 goes 00 => 01 => 11 => 10 => 00 from left to right. */
+static const uint8_t gray[4] = { 0x00, 0x01, 0x03, 0x02 };
+/* Expected at the end of the run, -1 for no expectation.  expect_bank is
+ * EXPECT_NONE for no input. */
+#define EXPECT_NONE 0xff
+static long expect_pos = -1;
+static int expect_bank = -1, expect_address = -1;
+static double expect_latency_ms = -1;
+
+/* Steps are the pin changes that make a step of the Gray sequence, which the
+ * firmware should act on.  Each one's latency runs from its edge to the end
+ * of sending the first frame that started rendering after it, going by the
+ * firmware's hal_mark() calls.  Of the steps so far, step_rendered are in the
+ * frame last rendered, step_pushed in the frame being sent, and step_shown
+ * have been sent and have a latency. */
+static uint64_t step_at[MAX_ENC_EDGES];
+static uint32_t step_latency[MAX_ENC_EDGES];
+static unsigned nsteps = 0, step_rendered = 0, step_pushed = 0;
+static unsigned step_shown = 0;
+/* Steps in the pin states the firmware read, which fall short of the steps
+ * made if it reads too late to see some of them. */
+static unsigned steps_read = 0;
+static uint8_t enc_read_pins = 0;
+
+static int
+gray_step(uint8_t from, uint8_t to)
+{
+	/* The step from one pin state to another, -1, 0 or +1 as the
+	 * firmware's enc_table has it. */
+	uint8_t i, j;
+
+	for (i = 0; gray[i] != (from & 0x03); i++)
+		;
+	for (j = 0; gray[j] != (to & 0x03); j++)
+		;
+	switch ((j - i) & 3) {
+	case 1:
+		return 1;
+	case 3:
+		return -1;
+	default:
+		return 0;
+	}
+}
+
+static void
+enc_add_spin(double seconds, int steps)
+{
+	/* Carry on from wherever the last spin or trace left the pins. */
+	uint8_t phase = 0;
+	uint64_t at = seconds * F_CPU;
+
+	if (enc_nedges) {
+		while (gray[phase] != enc_edges[enc_nedges - 1].pins)
+			phase++;
+		if (at < enc_edges[enc_nedges - 1].at)
+			at = enc_edges[enc_nedges - 1].at;
+	}
+
+	while (steps && (enc_nedges < MAX_ENC_EDGES)) {
+		phase = (phase + ((steps > 0) ? 1 : 3)) & 3;
+		steps += (steps > 0) ? -1 : 1;
+		at += enc_edge_cycles;
+		enc_edges[enc_nedges].at = at;
+		enc_edges[enc_nedges].pins = gray[phase];
+		enc_nedges++;
+	}
+}
+
+static void
+enc_add_trace(const char *path)
+{
+	/* Append the pin changes in the trace at path. */
+	char line[256], key[16];
+	unsigned bank, address, pd1, pd0;
+	double ms;
+	long n;
+	int lineno = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		exit(2);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if ((line[0] == '#') || (line[strspn(line, " \t\r\n")] == 0))
+			continue;
+		if (sscanf(line, "expect pos %ld", &n) == 1) {
+			expect_pos = n;
+		}
+		else if (sscanf(line, "expect latency %lf", &ms) == 1) {
+			expect_latency_ms = ms;
+		}
+		else if (sscanf(line, "expect input %15s", key) == 1) {
+			if (!strcmp(key, "none")) {
+				expect_bank = EXPECT_NONE;
+			}
+			else if (sscanf(key, "%u:%x", &bank, &address) == 2) {
+				expect_bank = bank;
+				expect_address = address;
+			}
+			else {
+				goto bad;
+			}
+		}
+		else if ((sscanf(line, "%lf %1u%1u", &ms, &pd1, &pd0) == 3)
+		         && (pd1 <= 1) && (pd0 <= 1)
+		         && (enc_nedges < MAX_ENC_EDGES)) {
+			enc_edges[enc_nedges].at = ms * (F_CPU / 1000);
+			enc_edges[enc_nedges].pins = (pd1 << 1) | pd0;
+			if (enc_nedges && (enc_edges[enc_nedges].at
+			                   < enc_edges[enc_nedges - 1].at))
+				goto bad;
+			enc_nedges++;
+		}
+		else {
+			goto bad;
+		}
+	}
+	fclose(f);
+	return;
+
+bad:
+	fprintf(stderr, "%s:%d: bad trace line\n", path, lineno);
+	exit(2);
+}
+
+static void
+enc_edge(void)
+{
+	uint8_t pins = enc_edges[enc_next++].pins;
+	uint8_t changed = pins ^ enc_pins;
+	uint8_t i, mode, bit;
+
+	if (gray_step(enc_pins, pins))
+		step_at[nsteps++] = now;
+	enc_pins = pins;
+	if (!enc_enabled)
+		return;
+
+	/* Each pin has two trigger bits, as in EICRA: 01 for any change, 10
+	 * for falling and 11 for rising. */
+	for (i = 0; i < 2; i++) {
+		bit = 1 << i;
+		mode = (enc_triggers >> (2 * i)) & 0x03;
+		if (!(changed & bit))
+			continue;
+		if ((mode == 1) || ((mode == 2) && !(pins & bit))
+		    || ((mode == 3) && (pins & bit))) {
+			if (i)
+				INT1_vect();
+			else
+				INT0_vect();
+		}
+	}
+}
+
+
+/* Timers. */
+
+static uint64_t ticks_base = 0;
+/* Timer 3, which also times CEC. */
+static uint64_t seconds_base = 0;
+static uint64_t seconds_at = NEVER;
+#define SECONDS_CYCLES (31250ULL * 256)
+/* Timer 1 compare A and B. */
+static uint64_t compa_at = NEVER;
+static uint64_t compb_at = NEVER;
+static uint64_t compc_at = NEVER;
+#define TICKS_WRAP_CYCLES (65536ULL * 256)
+/* Timer 2, the profiling timer, overflows every 256 * 128 cycles. */
+static uint64_t prof_base = 0;
+static uint64_t prof_at = NEVER;
+#define PROF_WRAP_CYCLES (256ULL * 128)
+
+
+/* Vertical sync.  With -v, the sync separator puts out a vertical sync pulse
+ * every vsync_period cycles, captured by timer 1 while the firmware has the
+ * interrupt enabled.  Without it there's no video and no pulses.  The audio
+ * mute is recorded so switches can be checked against it. */
+
+static uint64_t vsync_period = 0;
+static uint64_t vsync_at = NEVER;
+static uint8_t audio_muted = 0;
+static uint64_t audio_mute_at = 0;
+static double audio_mute_ms = -1.0;
+
+
+/* EEPROM. */
+
+#define EEPROM_SIZE 4096
+/* Each byte written takes about 3.3 ms. */
+#define EEPROM_WRITE_CYCLES (F_CPU * 33 / 10000)
+
+/* Where main.c saves the ribbon position once an input is centered. */
+#define EEPROM_POS_ADDRESS 0x000
+
+static uint8_t eeprom[EEPROM_SIZE];
+static uint64_t eeprom_writes = 0;
+static uint64_t eeprom_busy_until = 0;
+static uint8_t eeprom_irq = 0;
+static uint16_t eeprom_last_addr = 0;
+/* When the EE_READY interrupt was last turned off, having run out of
+ * things to write. */
+static uint64_t eeprom_idle_at = 0;
+
+
+/* Supply.  The supply can be made to fail at a given time, which trips the
+ * comparator, and the simulation then ends as if the power went away once the
+ * hold-up time has passed.  A write still in progress then is left torn. */
+
+static uint64_t power_fail_at = NEVER;
+static uint64_t power_dead_at = NEVER;
+static uint64_t power_holdup_cycles = F_CPU / 1000 * 350;
+static uint8_t power_low = 0;
+static uint8_t power_irq = 0;
+static uint8_t eeprom_torn = 0;
+
+
+/* Multiplexers.  Enabling a bank is an input switch, and its latency is
+ * measured from the last knob edge before it.  With -l, each switch is
+ * printed as it happens. */
+static uint8_t mux_address[HAL_MUX_BANKS];
+static uint8_t mux_enable = 0;
+static uint8_t switch_trace = 0;
+static uint64_t switches = 0, switches_muted = 0;
+/* When an input was first switched to after reset, for time-to-video. */
+static uint64_t first_switch_at = NEVER;
+static double switch_latency_ms = -1.0, switch_latency_max_ms = -1.0;
+/* How long after the last vertical sync pulse the switch came. */
+static double switch_vsync_us = -1.0, switch_vsync_max_us = -1.0;
+static struct timespec wall_start;
+
+
+/* HDMI-CEC.  The line is the wired AND of what the firmware drives and what
+ * the simulated devices on the bus do, which is send the frames given with
+ * -c, without arbitrating or waiting for the line to be free.  Nothing
+ * acknowledges.  Every frame on the line is decoded as a receiver would, and
+ * counted, and with -l printed as it ends. */
+
+#define CEC_TICK_CYCLES 256
+#define MAX_CEC_EDGES 65536
+#define MAX_CEC_BLOCKS 16
+
+static struct {
+	uint64_t at;
+	uint8_t low;
+} cec_edges[MAX_CEC_EDGES];
+static unsigned cec_nedges = 0, cec_next = 0;
+static uint8_t cec_switch_low = 0, cec_bus_low = 0, cec_low = 0;
+/* Input capture, and timer 3 compare B. */
+static uint8_t cec_capture_on = 0, cec_capture_rising = 0;
+static uint64_t cec_capture_at = NEVER;
+static uint16_t cec_icr = 0;
+static uint64_t cec_compb_at = NEVER;
+/* The decoder's frame, the bit it's up to in the current block, or -1
+ * between frames, and who sent the frame. */
+static uint8_t cec_frame[MAX_CEC_BLOCKS];
+static unsigned cec_frame_len = 0;
+static int cec_frame_bit = -1;
+static uint8_t cec_frame_eom = 0, cec_frame_switch = 0;
+static uint64_t cec_fell_at = 0;
+static uint8_t cec_fell_switch = 0;
+static uint64_t cec_frames = 0, cec_frames_sent = 0;
+
+static void
+cec_add_edge(uint64_t at, uint8_t low)
+{
+	if (cec_nedges < MAX_CEC_EDGES) {
+		cec_edges[cec_nedges].at = at;
+		cec_edges[cec_nedges].low = low;
+		cec_nedges++;
+	}
+}
+
+static void
+cec_add_frame(double seconds, const uint8_t *data, unsigned len)
+{
+	/* Have a device send a frame at seconds, or as soon after the last
+	 * one as it may. */
+	uint64_t at = seconds * F_CPU;
+	uint64_t tick = CEC_TICK_CYCLES;
+	unsigned block;
+	int bit, one;
+
+	if (cec_nedges && (at < cec_edges[cec_nedges - 1].at + 7 * 75 * tick))
+		at = cec_edges[cec_nedges - 1].at + 7 * 75 * tick;
+
+	/* Start bit, 3.7 ms low in 4.5 ms, then 2.4 ms data bits, low for
+	 * 0.6 ms for a 1 and 1.5 ms for a 0. */
+	cec_add_edge(at, 1);
+	cec_add_edge(at + 116 * tick, 0);
+	at += 141 * tick;
+	for (block = 0; block < len; block++) {
+		for (bit = 0; bit < 10; bit++) {
+			if (bit < 8)
+				one = (data[block] >> (7 - bit)) & 1;
+			else if (bit == 8)
+				one = (block == len - 1);
+			else
+				one = 1;
+			cec_add_edge(at, 1);
+			cec_add_edge(at + (one ? 19 : 47) * tick, 0);
+			at += 75 * tick;
+		}
+	}
+}
+
+static void
+cec_decode(void)
+{
+	/* Follow an edge on the line. */
+	unsigned i, ticks;
+	uint8_t one;
+
+	if (cec_low) {
+		cec_fell_at = now;
+		cec_fell_switch = cec_switch_low;
+		return;
+	}
+	ticks = (now - cec_fell_at) / CEC_TICK_CYCLES;
+	if (ticks >= 109) {
+		cec_frame_bit = 0;
+		cec_frame_len = 0;
+		cec_frame_switch = cec_fell_switch;
+		memset(cec_frame, 0, sizeof(cec_frame));
+		return;
+	}
+	if (cec_frame_bit < 0)
+		return;
+	one = (ticks <= 33);
+	if (cec_frame_bit < 8) {
+		if (cec_frame_len < MAX_CEC_BLOCKS)
+			cec_frame[cec_frame_len] = (cec_frame[cec_frame_len] << 1)
+			                           | one;
+		cec_frame_bit++;
+	}
+	else if (cec_frame_bit == 8) {
+		cec_frame_eom = one;
+		cec_frame_bit++;
+	}
+	else {
+		if (cec_frame_len < MAX_CEC_BLOCKS)
+			cec_frame_len++;
+		cec_frame_bit = 0;
+		if (!cec_frame_eom)
+			return;
+		cec_frame_bit = -1;
+		cec_frames++;
+		if (cec_frame_switch)
+			cec_frames_sent++;
+		if (switch_trace) {
+			printf("cec %.3f from %s", (double)now / F_CPU,
+			       cec_frame_switch ? "switch" : "bus");
+			for (i = 0; i < cec_frame_len; i++)
+				printf("%c%02x", i ? ':' : ' ', cec_frame[i]);
+			printf("\n");
+		}
+	}
+}
+
+static void
+cec_update(void)
+{
+	/* Work out the line after either side has changed what it drives. */
+	uint8_t low = cec_switch_low || cec_bus_low;
+
+	if (low == cec_low)
+		return;
+	cec_low = low;
+	cec_decode();
+	if (cec_capture_on && (cec_capture_rising == !low)
+	    && (cec_capture_at == NEVER)) {
+		cec_capture_at = now;
+		cec_icr = (now - seconds_base) >> 8;
+	}
+}
+
+static int
+latency_compare(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+step_latency_ms(unsigned percent)
+{
+	/* The percentile of the step latencies, which must be sorted, or -1
+	 * if no step reached the VFD. */
+	if (!step_shown)
+		return -1.0;
+	return (double)step_latency[(step_shown - 1) * percent / 100] * 1000
+	       / F_CPU;
+}
+
+static void
+finish(void)
+{
+	struct timespec wall_end;
+	double wall;
+	FILE *f;
+	int i, bank, failures = 0;
+	long pos;
+
+	clock_gettime(CLOCK_MONOTONIC, &wall_end);
+	wall = (wall_end.tv_sec - wall_start.tv_sec)
+	       + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9;
+
+	if (out_path)
+		vfd_save(out_path);
+	if (eeprom_path) {
+		f = fopen(eeprom_path, "wb");
+		if (!f || (fwrite(eeprom, EEPROM_SIZE, 1, f) != 1)) {
+			perror(eeprom_path);
+			exit(1);
+		}
+		fclose(f);
+	}
+
+	printf("simulated_seconds %.3f\n", (double)now / F_CPU);
+	printf("vfd_bytes %lu\n", (unsigned long)vfd.bytes);
+	printf("vfd_images %lu\n", (unsigned long)vfd.images);
+	printf("vfd_image_bytes %lu\n", (unsigned long)vfd.image_bytes);
+	printf("vfd_scrolls %lu\n", (unsigned long)vfd.scrolls);
+	printf("vfd_retries %lu\n", (unsigned long)retries);
+	printf("vfd_retry_cycles %lu\n",
+	       (unsigned long)(retries * RETRY_ISR_CYCLES));
+	printf("vfd_brightness %u\n", vfd.brightness);
+	printf("vfd_power %u\n", vfd.power);
+	/* The first bank's address, then any others'. */
+	printf("mux_address 0x%02x\n", mux_address[0]);
+	for (i = 1; i < HAL_MUX_BANKS; i++)
+		printf("mux_address_%d 0x%02x\n", i, mux_address[i]);
+	printf("mux_enable 0x%02x\n", mux_enable);
+	printf("mux_switches %lu\n", (unsigned long)switches);
+	printf("switch_latency_ms %.1f\n", switch_latency_ms);
+	printf("switch_latency_max_ms %.1f\n", switch_latency_max_ms);
+	printf("switch_vsync_us %.0f\n", switch_vsync_us);
+	printf("switch_vsync_max_us %.0f\n", switch_vsync_max_us);
+	printf("switches_muted %lu\n", (unsigned long)switches_muted);
+	/* From reset to the first input switched to, and to the first image
+	 * on the VFD, or -1 if there wasn't one. */
+	printf("boot_video_ms %.3f\n", (first_switch_at == NEVER) ? -1.0 :
+	       (double)first_switch_at * 1000 / F_CPU);
+	printf("boot_frame_ms %.3f\n", !vfd.images ? -1.0 :
+	       (double)vfd.first_image_at * 1000 / F_CPU);
+	printf("audio_mute_ms %.1f\n", audio_mute_ms);
+	printf("eeprom_writes %lu\n", (unsigned long)eeprom_writes);
+	printf("cec_frames %lu\n", (unsigned long)cec_frames);
+	printf("cec_frames_sent %lu\n", (unsigned long)cec_frames_sent);
+	/* Knob steps made, and how many of those the firmware didn't read or
+	 * never showed, then the percentiles of the latencies of the rest. */
+	qsort(step_latency, step_shown, sizeof(step_latency[0]),
+	      latency_compare);
+	printf("knob_steps %u\n", nsteps);
+	printf("knob_steps_missed %d\n", (int)(nsteps - steps_read));
+	printf("knob_steps_unshown %u\n", nsteps - step_shown);
+	printf("knob_latency_p50_ms %.1f\n", step_latency_ms(50));
+	printf("knob_latency_p90_ms %.1f\n", step_latency_ms(90));
+	printf("knob_latency_p99_ms %.1f\n", step_latency_ms(99));
+	printf("knob_latency_max_ms %.1f\n", step_latency_ms(100));
+	/* The position saved and the input switched to, for checking against
+	 * a trace's expectations. */
+	pos = eeprom[EEPROM_POS_ADDRESS]
+	      | (eeprom[EEPROM_POS_ADDRESS + 1] << 8);
+	if (pos == 0xffff)
+		pos = -1;
+	for (bank = 0; (bank < HAL_MUX_BANKS) && !(mux_enable & (1 << bank));
+	     bank++)
+		;
+	printf("pos %ld\n", pos);
+	if (bank < HAL_MUX_BANKS)
+		printf("input %d:0x%02x\n", bank, mux_address[bank]);
+	else
+		printf("input none\n");
+	if ((expect_pos >= 0) && (pos != expect_pos)) {
+		fprintf(stderr, "expected pos %ld\n", expect_pos);
+		failures++;
+	}
+	if ((expect_bank == EXPECT_NONE) && (bank < HAL_MUX_BANKS)) {
+		fprintf(stderr, "expected input none\n");
+		failures++;
+	}
+	else if ((expect_bank >= 0) && (expect_bank != EXPECT_NONE)
+	         && ((bank != expect_bank)
+	             || (mux_address[bank] != expect_address))) {
+		fprintf(stderr, "expected input %d:0x%02x\n", expect_bank,
+		        expect_address);
+		failures++;
+	}
+	/* A step that was never shown has no latency, but fails the bound
+	 * all the same. */
+	if ((expect_latency_ms >= 0)
+	    && ((step_shown < nsteps)
+	        || (step_latency_ms(100) > expect_latency_ms))) {
+		fprintf(stderr, "expected knob latency at most %.1f ms\n",
+		        expect_latency_ms);
+		failures++;
+	}
+	if ((expect_pos >= 0) || (expect_bank >= 0)
+	    || (expect_latency_ms >= 0))
+		printf("expect_failures %d\n", failures);
+	if (power_low) {
+		/* How long after the comparator tripped the EEPROM was done
+		 * with, or -1 if the power went before it was. */
+		printf("power_fail_flush_ms %.1f\n",
+		       eeprom_irq ? -1.0 :
+		       (eeprom_idle_at > power_fail_at ?
+		        (double)(eeprom_idle_at - power_fail_at) * 1000 / F_CPU :
+		        0.0));
+		printf("eeprom_torn %u\n", eeprom_torn);
+	}
+	printf("sleep_seconds %.3f\n", (double)sleep_cycles / F_CPU);
+	printf("wall_seconds %.6f\n", wall);
+	exit(failures ? 1 : 0);
+}
+
+static int
+run_next(uint64_t until)
+{
+	/* Run the next interrupt if it falls due by until, advancing time to
+	 * it.  Returns 0 if there isn't one. */
+	uint64_t next, ee_at;
+
+	next = spi_at;
+	if (retry_at < next)
+		next = retry_at;
+	if (seconds_at < next)
+		next = seconds_at;
+	if (prof_at < next)
+		next = prof_at;
+	if (compa_at < next)
+		next = compa_at;
+	if (compb_at < next)
+		next = compb_at;
+	if (compc_at < next)
+		next = compc_at;
+	if (vsync_at < next)
+		next = vsync_at;
+	if (cec_compb_at < next)
+		next = cec_compb_at;
+	if (cec_capture_at < next)
+		next = cec_capture_at;
+	if ((cec_next < cec_nedges) && (cec_edges[cec_next].at < next))
+		next = cec_edges[cec_next].at;
+	if ((enc_next < enc_nedges) && (enc_edges[enc_next].at < next))
+		next = enc_edges[enc_next].at;
+	if (!power_low && (power_fail_at < next))
+		next = power_fail_at;
+	if (power_dead_at < next)
+		next = power_dead_at;
+	/* EE_READY fires for as long as it's enabled and the EEPROM isn't
+	 * busy. */
+	ee_at = NEVER;
+	if (eeprom_irq)
+		ee_at = (eeprom_busy_until > now) ? eeprom_busy_until : now;
+	if (ee_at < next)
+		next = ee_at;
+	if (next > until)
+		return 0;
+	if (next > now)
+		now = next;
+
+	if (next == spi_at) {
+		spi_at = NEVER;
+		SPI_STC_vect();
+	}
+	else if (next == retry_at) {
+		retry_at = now + retry_cycles;
+		retries++;
+		TIMER0_COMPA_vect();
+	}
+	else if (next == seconds_at) {
+		seconds_at += SECONDS_CYCLES;
+		TIMER3_COMPA_vect();
+	}
+	else if (next == prof_at) {
+		prof_at += PROF_WRAP_CYCLES;
+		TIMER2_OVF_vect();
+	}
+	else if (next == compa_at) {
+		compa_at += TICKS_WRAP_CYCLES;
+		TIMER1_COMPA_vect();
+	}
+	else if (next == compb_at) {
+		compb_at += TICKS_WRAP_CYCLES;
+		TIMER1_COMPB_vect();
+	}
+	else if (next == compc_at) {
+		compc_at += TICKS_WRAP_CYCLES;
+		TIMER1_COMPC_vect();
+	}
+	else if (next == vsync_at) {
+		vsync_at += vsync_period;
+		TIMER1_CAPT_vect();
+	}
+	else if (next == cec_compb_at) {
+		cec_compb_at += TICKS_WRAP_CYCLES;
+		TIMER3_COMPB_vect();
+	}
+	else if (next == cec_capture_at) {
+		cec_capture_at = NEVER;
+		TIMER3_CAPT_vect();
+	}
+	else if ((cec_next < cec_nedges) && (next == cec_edges[cec_next].at)) {
+		cec_bus_low = cec_edges[cec_next++].low;
+		cec_update();
+	}
+	else if (next == ee_at) {
+		EE_READY_vect();
+	}
+	else if (next == power_dead_at) {
+		if (eeprom_busy_until > now) {
+			eeprom[eeprom_last_addr] = 0xff;
+			eeprom_torn = 1;
+		}
+		finish();
+	}
+	else if (next == power_fail_at) {
+		power_low = 1;
+		power_dead_at = now + power_holdup_cycles;
+		if (power_irq)
+			ANALOG_COMP_vect();
+	}
+	else {
+		enc_edge();
+	}
+	return 1;
+}
+
+static void
+run_until(uint64_t until)
+{
+	/* Advance time to until, running interrupts as they fall due. */
+	while (run_next(until))
+		;
+	if (until > now)
+		now = until;
+	if (now >= run_cycles)
+		finish();
+}
+
+void
+hal_idle(void)
+{
+	run_until(now + idle_cycles);
+}
+
+void
+hal_sleep(void)
+{
+	uint64_t start = now;
+
+	if (!run_next(run_cycles))
+		now = run_cycles;
+	sleep_cycles += now - start;
+	if (now >= run_cycles)
+		finish();
+}
+
+void
+hal_clock_init(void)
+{
+}
+
+void
+hal_delay_ms(double ms)
+{
+	run_until(now + (uint64_t)(ms * (F_CPU / 1000)));
+}
+
+void
+hal_delay_us(double us)
+{
+	run_until(now + (uint64_t)(us * (F_CPU / 1000000)));
+}
+
+void
+hal_mux_init(uint8_t banks)
+{
+}
+
+void
+hal_mux_write(uint8_t bank, uint8_t address)
+{
+	if (bank < HAL_MUX_BANKS)
+		mux_address[bank] = address;
+}
+
+void
+hal_mux_enable(uint8_t banks)
+{
+	uint8_t b;
+
+	mux_enable = banks & ((1 << HAL_MUX_BANKS) - 1);
+	if (!mux_enable)
+		return;
+	if (!switches++)
+		first_switch_at = now;
+	switch_latency_ms = -1.0;
+	if (enc_next) {
+		switch_latency_ms = (now - enc_edges[enc_next - 1].at)
+		                    * 1000.0 / F_CPU;
+		if (switch_latency_ms > switch_latency_max_ms)
+			switch_latency_max_ms = switch_latency_ms;
+	}
+	if (vsync_period) {
+		switch_vsync_us = (now % vsync_period) * 1e6 / F_CPU;
+		if (switch_vsync_us > switch_vsync_max_us)
+			switch_vsync_max_us = switch_vsync_us;
+	}
+	if (audio_muted)
+		switches_muted++;
+	if (switch_trace) {
+		for (b = 0; !(mux_enable & (1 << b)); b++)
+			;
+		printf("switch %.3f bank %u address 0x%02x latency_ms %.1f "
+		       "vsync_us %.0f muted %u\n",
+		       (double)now / F_CPU, b, mux_address[b],
+		       switch_latency_ms, switch_vsync_us, audio_muted);
+	}
+}
+
+void
+hal_spi_init(void)
+{
+}
+
+void
+hal_spi_write(uint8_t data)
+{
+	vfd_receive(data);
+	spi_at = now + SPI_BYTE_CYCLES;
+	busy_until = spi_at + busy_cycles;
+}
+
+void
+hal_vfd_reset_init(void)
+{
+}
+
+void
+hal_vfd_reset(uint8_t high)
+{
+	if (high && !reset_level)
+		busy_until = now + VFD_RESET_BUSY_CYCLES;
+	reset_level = high;
+}
+
+uint8_t
+hal_vfd_busy(void)
+{
+	return now < busy_until;
+}
+
+void
+hal_vfd_retry_init(void)
+{
+}
+
+void
+hal_vfd_retry_arm(uint8_t us)
+{
+	retry_cycles = us * (F_CPU / 1000000);
+	retry_at = now + retry_cycles;
+}
+
+void
+hal_vfd_retry_disarm(void)
+{
+	retry_at = NEVER;
+}
+
+void
+hal_encoder_init(void)
+{
+}
+
+uint8_t
+hal_encoder_read(void)
+{
+	if (gray_step(enc_read_pins, enc_pins))
+		steps_read++;
+	enc_read_pins = enc_pins;
+	return enc_pins;
+}
+
+void
+hal_encoder_arm(uint8_t triggers)
+{
+	enc_triggers = triggers;
+	enc_enabled = 1;
+}
+
+void
+hal_mark(uint8_t id)
+{
+	switch (id) {
+	case MARK_BLIT_RIBBON:
+		step_rendered = nsteps;
+		break;
+	case MARK_FRAME_PUSH:
+		step_pushed = step_rendered;
+		break;
+	case MARK_FRAME_PUSH | MARK_END:
+		for (; step_shown < step_pushed; step_shown++)
+			step_latency[step_shown] = now - step_at[step_shown];
+		break;
+	}
+}
+
+void
+hal_ticks_init(void)
+{
+	ticks_base = now;
+}
+
+uint16_t
+hal_ticks(void)
+{
+	return (now - ticks_base) >> 8;
+}
+
+static uint64_t
+ticks_match(uint64_t base, uint16_t at)
+{
+	/* When a timer started at base next reaches at, as for an output
+	 * compare. */
+	uint64_t t = (now - base) >> 8;
+	uint32_t delta = (uint16_t)(at - t);
+
+	if (delta == 0)
+		delta = 0x10000;
+	return base + ((t + delta) << 8);
+}
+
+void
+hal_deadline_arm(uint16_t at)
+{
+	compa_at = ticks_match(ticks_base, at);
+}
+
+void
+hal_deadline_disarm(void)
+{
+	compa_at = NEVER;
+}
+
+void
+hal_frame_arm(uint16_t at)
+{
+	compb_at = ticks_match(ticks_base, at);
+}
+
+void
+hal_frame_disarm(void)
+{
+	compb_at = NEVER;
+}
+
+void
+hal_switch_arm(uint16_t at)
+{
+	compc_at = ticks_match(ticks_base, at);
+}
+
+void
+hal_switch_disarm(void)
+{
+	compc_at = NEVER;
+}
+
+void
+hal_prof_init(void)
+{
+	prof_base = now;
+	prof_at = now + PROF_WRAP_CYCLES;
+}
+
+uint8_t
+hal_prof_count(void)
+{
+	return (now - prof_base) >> 7;
+}
+
+uint8_t
+hal_prof_overflow(void)
+{
+	/* Interrupts run as soon as they're due, so one is never left
+	 * waiting. */
+	return 0;
+}
+
+uint16_t
+hal_stack_used(void)
+{
+	return 0;
+}
+
+void
+hal_vsync_init(void)
+{
+}
+
+void
+hal_vsync_arm(void)
+{
+	/* The next pulse after now. */
+	if (vsync_period)
+		vsync_at = (now / vsync_period + 1) * vsync_period;
+}
+
+void
+hal_vsync_disarm(void)
+{
+	vsync_at = NEVER;
+}
+
+void
+hal_audio_init(void)
+{
+}
+
+void
+hal_audio_mute(uint8_t mute)
+{
+	if (mute && !audio_muted)
+		audio_mute_at = now;
+	else if (!mute && audio_muted)
+		audio_mute_ms = (now - audio_mute_at) * 1000.0 / F_CPU;
+	audio_muted = mute;
+}
+
+void
+hal_seconds_init(void)
+{
+	seconds_base = now;
+	seconds_at = now + SECONDS_CYCLES;
+}
+
+void
+hal_seconds_next(void)
+{
+	/* The simulation moves the compare on by itself. */
+}
+
+void
+hal_cec_init(void)
+{
+}
+
+uint16_t
+hal_cec_ticks(void)
+{
+	return (now - seconds_base) >> 8;
+}
+
+void
+hal_cec_drive(uint8_t low)
+{
+	cec_switch_low = low;
+	cec_update();
+}
+
+uint8_t
+hal_cec_line(void)
+{
+	return !cec_low;
+}
+
+void
+hal_cec_capture(uint8_t rising)
+{
+	cec_capture_on = 1;
+	cec_capture_rising = rising;
+	cec_capture_at = NEVER;
+}
+
+void
+hal_cec_capture_off(void)
+{
+	cec_capture_on = 0;
+	cec_capture_at = NEVER;
+}
+
+uint16_t
+hal_cec_captured(void)
+{
+	return cec_icr;
+}
+
+void
+hal_cec_arm(uint16_t at)
+{
+	cec_compb_at = ticks_match(seconds_base, at);
+}
+
+void
+hal_cec_disarm(void)
+{
+	cec_compb_at = NEVER;
+}
+
+uint8_t
+hal_eeprom_read_byte(uint16_t addr)
+{
+	return eeprom[addr % EEPROM_SIZE];
+}
+
+uint16_t
+hal_eeprom_read_word(uint16_t addr)
+{
+	return hal_eeprom_read_byte(addr)
+	       | (hal_eeprom_read_byte(addr + 1) << 8);
+}
+
+void
+hal_eeprom_read_block(void *dst, uint16_t addr, uint16_t len)
+{
+	uint8_t *d = dst;
+
+	while (len--)
+		*d++ = hal_eeprom_read_byte(addr++);
+}
+
+void
+hal_eeprom_write_start(uint16_t addr, uint8_t value)
+{
+	eeprom_last_addr = addr % EEPROM_SIZE;
+	eeprom[eeprom_last_addr] = value;
+	eeprom_writes++;
+	eeprom_busy_until = now + EEPROM_WRITE_CYCLES;
+}
+
+void
+hal_eeprom_ready_irq(uint8_t enable)
+{
+	if (eeprom_irq && !enable)
+		eeprom_idle_at = now;
+	eeprom_irq = enable;
+}
+
+void
+hal_power_init(void)
+{
+	power_irq = 1;
+}
+
+uint8_t
+hal_power_low(void)
+{
+	return power_low;
+}
+
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+	        "usage: %s [options]\n"
+	        "  -t SECONDS    simulated run time (default 10)\n"
+	        "  -s TIME:STEPS turn the knob STEPS edges (negative is left)\n"
+	        "                starting at TIME seconds, may be repeated\n"
+	        "  -r HZ         edge rate for -s (default 500)\n"
+	        "  -T FILE       replay the knob trace in FILE, and check the\n"
+	        "                end of the run against its expectations\n"
+	        "  -i CYCLES     cycles that pass per hal_idle() (default 2000)\n"
+	        "  -B CYCLES     VFD busy time after each byte (default 80)\n"
+	        "  -e FILE       load EEPROM from FILE and save it on exit\n"
+	        "  -p TIME[:MS]  fail the supply at TIME seconds, with MS of\n"
+	        "                hold-up before the power goes (default 350)\n"
+	        "  -o FILE       save the final VFD contents as a PGM image\n"
+	        "  -d DIR        save every bit image write as DIR/frameN.pgm\n"
+	        "  -l            print each input switch, with its latency from\n"
+	        "                the last knob edge, and each CEC frame\n"
+	        "  -v HZ         vertical sync pulses at HZ (default none)\n"
+	        "  -c TIME:XX:XX...\n"
+	        "                another device sends the CEC frame of hex bytes\n"
+	        "                XX:XX... at TIME seconds, may be repeated\n",
+	        prog);
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	double t;
+	int opt, steps;
+	FILE *f;
+	uint8_t frame[MAX_CEC_BLOCKS];
+	unsigned len;
+	char *p;
+
+	memset(eeprom, 0xff, EEPROM_SIZE);
+	vfd.power = 1;
+
+	while ((opt = getopt(argc, argv, "t:s:r:T:i:B:e:p:o:d:lv:c:")) != -1) {
+		switch (opt) {
+		case 't':
+			run_cycles = atof(optarg) * F_CPU;
+			break;
+		case 's':
+			if (sscanf(optarg, "%lf:%d", &t, &steps) != 2)
+				usage(argv[0]);
+			enc_add_spin(t, steps);
+			break;
+		case 'r':
+			enc_edge_cycles = F_CPU / atof(optarg);
+			break;
+		case 'T':
+			enc_add_trace(optarg);
+			break;
+		case 'i':
+			idle_cycles = strtoull(optarg, NULL, 0);
+			break;
+		case 'B':
+			busy_cycles = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			eeprom_path = optarg;
+			f = fopen(eeprom_path, "rb");
+			if (f) {
+				if (fread(eeprom, 1, EEPROM_SIZE, f) == 0)
+					memset(eeprom, 0xff, EEPROM_SIZE);
+				fclose(f);
+			}
+			break;
+		case 'p':
+			t = atof(optarg);
+			power_fail_at = t * F_CPU;
+			if (strchr(optarg, ':'))
+				power_holdup_cycles = atof(strchr(optarg, ':') + 1)
+				                      * (F_CPU / 1000);
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'd':
+			dump_dir = optarg;
+			break;
+		case 'l':
+			switch_trace = 1;
+			break;
+		case 'v':
+			vsync_period = F_CPU / atof(optarg);
+			break;
+		case 'c':
+			t = strtod(optarg, &p);
+			for (len = 0; (*p == ':') && (len < MAX_CEC_BLOCKS);
+			     len++)
+				frame[len] = strtoul(p + 1, &p, 16);
+			if (!len || *p)
+				usage(argv[0]);
+			cec_add_frame(t, frame, len);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &wall_start);
+	firmware_boot();
+	firmware_main();
+	finish();
+	return 0;
+}
@@ -0,0 +1,143 @@
+#ifndef HAL_HOST_H
+#define HAL_HOST_H
+
+/* Host implementation of the hardware abstraction layer in hal.h.  The
+ * firmware runs as an ordinary program against a simulated clock, encoder,
+ * EEPROM and a mock VFD that decodes the commands sent over SPI into a
+ * framebuffer.  See host/hal_host.c. */
+
+#include <stdint.h>
+#include <string.h>
+
+/* Constant data is just ordinary memory. */
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define memcpy_P(dst, src, n) memcpy(dst, src, n)
+
+/* host/hal_host.c provides main() to parse its command line, and then calls
+ * the firmware's main() under this name. */
+#define main firmware_main
+int firmware_main(void);
+/* And BOOT() before it, once the EEPROM has been loaded. */
+#define BOOT() void firmware_boot(void)
+void firmware_boot(void);
+
+/* Interrupt handlers are plain functions called by the simulation whenever
+ * the firmware calls hal_idle(), so interrupts never preempt main.c in the
+ * middle of anything and cli()/sei() have nothing to do. */
+#define ISR(vector) void vector(void)
+#define cli() do { } while (0)
+#define sei() do { } while (0)
+
+#define INT0_vect         host_isr_int0
+#define INT1_vect         host_isr_int1
+#define SPI_STC_vect      host_isr_spi_stc
+#define TIMER0_COMPA_vect host_isr_timer0_compa
+#define TIMER2_OVF_vect   host_isr_timer2_ovf
+#define TIMER1_COMPA_vect host_isr_timer1_compa
+#define TIMER1_COMPB_vect host_isr_timer1_compb
+#define TIMER1_COMPC_vect host_isr_timer1_compc
+#define TIMER1_CAPT_vect  host_isr_timer1_capt
+#define TIMER3_COMPA_vect host_isr_timer3_compa
+#define TIMER3_COMPB_vect host_isr_timer3_compb
+#define TIMER3_CAPT_vect  host_isr_timer3_capt
+#define EE_READY_vect     host_isr_ee_ready
+#define ANALOG_COMP_vect  host_isr_analog_comp
+
+void INT0_vect(void);
+void INT1_vect(void);
+void SPI_STC_vect(void);
+void TIMER0_COMPA_vect(void);
+void TIMER2_OVF_vect(void);
+void TIMER1_COMPA_vect(void);
+void TIMER1_COMPB_vect(void);
+void TIMER1_COMPC_vect(void);
+void TIMER1_CAPT_vect(void);
+void TIMER3_COMPA_vect(void);
+void TIMER3_COMPB_vect(void);
+void TIMER3_CAPT_vect(void);
+void EE_READY_vect(void);
+void ANALOG_COMP_vect(void);
+
+/* Let a slice of simulated time pass, running any interrupts that fall due
+ * in it.  Exits the program once the requested run time has elapsed. */
+void hal_idle(void);
+/* Let time pass up to the next interrupt and run it. */
+void hal_sleep(void);
+
+void hal_clock_init(void);
+void hal_delay_ms(double ms);
+void hal_delay_us(double us);
+
+/* As many multiplexer banks as the board has. */
+#define HAL_MUX_BANKS 3
+
+void hal_mux_init(uint8_t banks);
+void hal_mux_write(uint8_t bank, uint8_t address);
+void hal_mux_enable(uint8_t banks);
+
+void hal_spi_init(void);
+void hal_spi_write(uint8_t data);
+void hal_vfd_reset_init(void);
+void hal_vfd_reset(uint8_t high);
+uint8_t hal_vfd_busy(void);
+void hal_vfd_retry_init(void);
+void hal_vfd_retry_arm(uint8_t us);
+void hal_vfd_retry_disarm(void);
+
+/* Same encoding as EICRA on the AVR. */
+#define ENC_INT_1_ANY 0x04
+#define ENC_INT_0_ANY 0x01
+
+void hal_encoder_init(void);
+uint8_t hal_encoder_read(void);
+void hal_encoder_arm(uint8_t triggers);
+
+void hal_ticks_init(void);
+uint16_t hal_ticks(void);
+void hal_deadline_arm(uint16_t at);
+void hal_deadline_disarm(void);
+void hal_frame_arm(uint16_t at);
+void hal_frame_disarm(void);
+void hal_switch_arm(uint16_t at);
+void hal_switch_disarm(void);
+void hal_seconds_init(void);
+void hal_seconds_next(void);
+
+void hal_cec_init(void);
+uint16_t hal_cec_ticks(void);
+void hal_cec_drive(uint8_t low);
+uint8_t hal_cec_line(void);
+void hal_cec_capture(uint8_t rising);
+void hal_cec_capture_off(void);
+uint16_t hal_cec_captured(void);
+void hal_cec_arm(uint16_t at);
+void hal_cec_disarm(void);
+
+void hal_prof_init(void);
+uint8_t hal_prof_count(void);
+uint8_t hal_prof_overflow(void);
+/* There's no stack to speak of on the host, so this is always 0. */
+uint16_t hal_stack_used(void);
+
+void hal_vsync_init(void);
+void hal_vsync_arm(void);
+void hal_vsync_disarm(void);
+void hal_audio_init(void);
+void hal_audio_mute(uint8_t mute);
+
+/* The markers in host/marks.h, to time how long each knob step takes to reach
+ * the VFD. */
+void hal_mark(uint8_t id);
+
+uint8_t hal_eeprom_read_byte(uint16_t addr);
+uint16_t hal_eeprom_read_word(uint16_t addr);
+void hal_eeprom_read_block(void *dst, uint16_t addr, uint16_t len);
+void hal_eeprom_write_start(uint16_t addr, uint8_t value);
+void hal_eeprom_ready_irq(uint8_t enable);
+
+void hal_power_init(void);
+uint8_t hal_power_low(void);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef HOST_MARKS_H
+#define HOST_MARKS_H
+
+/* Markers the firmware passes to hal_mark() around the code the host build
+ * times a knob step's way to the VFD by.  A region starts with its marker and
+ * ends with the same marker or'd with MARK_END.  If a region ends more than
+ * once before it starts again, the last end counts. */
+
+#define MARK_BLIT_RIBBON 1
+/* From starting to queue a frame to the VFD until the SPI interrupt has
+ * sent the last of it. */
+#define MARK_FRAME_PUSH  2
+
+#define MARK_END 0x80
+
+#endif
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""Cycle the power on the host build many times and check that the uptimes
+survive.
+
+    power_cycles.py [-n CYCLES] [--host ./main_host]
+
+Each cycle runs the host firmware against the same EEPROM file for just over
+a minute, with the supply failing at the end, so the total uptime should go
+up by one minute a cycle.  After each one the uptime journal is read back out
+of the EEPROM the way journal_load() in main.c does it, and the run fails if
+there's no complete checkpoint left in it or the total uptime is wrong.  The
+default number of cycles wraps the journal a few times over.
+"""
+import argparse
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+# From main.c.
+JOURNAL_ADDRESS = 0x100
+JOURNAL_SLOTS = 480
+JOURNAL_CHECKPOINT = 0x40
+JOURNAL_KIND_MASK = 0xc0
+JOURNAL_ID_MASK = 0x3f
+JOURNAL_CRC_INIT = 0x5a
+NUM_INPUTS = 11
+RECORD = struct.Struct('<HBBI')
+
+
+def crc(data):
+    c = JOURNAL_CRC_INIT
+    for i, b in enumerate(data):
+        if i == 3:
+            continue
+        c ^= b
+        for _ in range(8):
+            c = ((c << 1) ^ 0x07 if c & 0x80 else c << 1) & 0xff
+    return c
+
+
+def read(eeprom, slot):
+    offset = JOURNAL_ADDRESS + slot * RECORD.size
+    data = eeprom[offset:offset + RECORD.size]
+    seq, tag, c, value = RECORD.unpack(data)
+    if c != crc(data) or (tag & JOURNAL_ID_MASK) >= NUM_INPUTS:
+        return None
+    return seq, tag, value
+
+
+def load(eeprom):
+    """Return the uptimes from the journal, or None if it has no complete
+    checkpoint."""
+    records = [read(eeprom, slot) for slot in range(JOURNAL_SLOTS)]
+    head = None
+    for slot, r in enumerate(records):
+        if r and (head is None or
+                  ((r[0] - records[head][0]) & 0xffff) - 1 < 0x7fff):
+            head = slot
+    if head is None:
+        return None
+    # Walk back to the newest complete checkpoint, then replay forwards.
+    want = NUM_INPUTS - 1
+    for n in range(JOURNAL_SLOTS):
+        r = records[(head - n) % JOURNAL_SLOTS]
+        if not r or r[0] != (records[head][0] - n) & 0xffff:
+            return None
+        if r[1] & JOURNAL_KIND_MASK != JOURNAL_CHECKPOINT:
+            want = NUM_INPUTS - 1
+            continue
+        t = r[1] & JOURNAL_ID_MASK
+        if t != want:
+            want = NUM_INPUTS - 1
+        if t != want:
+            continue
+        if want:
+            want -= 1
+            continue
+        uptimes = [0] * NUM_INPUTS
+        for m in range(n, -1, -1):
+            _, tag, value = records[(head - m) % JOURNAL_SLOTS]
+            t = tag & JOURNAL_ID_MASK
+            if tag & JOURNAL_KIND_MASK == JOURNAL_CHECKPOINT:
+                uptimes[t] = value
+            else:
+                uptimes[t] += value
+        return uptimes
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__.split('\n\n')[0].replace('\n', ' '))
+    parser.add_argument('-n', type=int, default=JOURNAL_SLOTS * 3,
+                        help='number of power cycles')
+    parser.add_argument('--host', default='./main_host')
+    args = parser.parse_args()
+
+    fd, path = tempfile.mkstemp(suffix='.eep')
+    os.close(fd)
+    os.unlink(path)
+    try:
+        for cycle in range(1, args.n + 1):
+            subprocess.run([args.host, '-t', '62', '-p', '61:350',
+                            '-e', path],
+                           stdout=subprocess.DEVNULL, check=True)
+            with open(path, 'rb') as f:
+                uptimes = load(f.read())
+            if uptimes is None:
+                sys.exit('cycle %d: no complete checkpoint' % cycle)
+            if uptimes[0] != cycle:
+                sys.exit('cycle %d: total uptime %d' % (cycle, uptimes[0]))
+    finally:
+        if os.path.exists(path):
+            os.unlink(path)
+    print('power_cycles %d' % args.n)
+
+
+if __name__ == '__main__':
+    main()
@@ -1,198 +1,950 @@
-#define F_CPU 8000000UL
-
 #include <string.h>
-#include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <avr/eeprom.h>
-#include <util/delay.h>
+/* All register access goes through here. */
+#include "hal.h"
+
+/* Markers for the host build to time knob steps by.  See host/. */
+#include "host/marks.h"
 
 /* Programmatically-generated header containing bitmap data for ribbon of logos
  * generated from PNG files as well as addresses, display names, and ribbon
- * indexes for each input.  This is where inputs[] is defined!
+ * indexes for each input.  This is where inputs[] is defined, along with
+ * input_edges[], input_centers[] and the input_blocks[] lookup in flash.
  */
 #include "ribbon.h"
 
-/* Font used for for the uptime scroll.  Also programmatically-generated. */
-#include "font.h"
+/* The VFD's geometry, generated by stitch.py for the panel picked by DISPLAY
+ * in the Makefile.  Everything sized by the display is a compile-time
+ * constant, so the blitters' loops are specialized for it. */
+#include "display.h"
 
+/* Font used for for the uptime scroll.  Also programmatically-generated.  Both
+ * this and the ribbon are stored in flash and read with pgm_read_byte(). */
+#include "font.h"
 
-static void
-spi_init(void)
+#if MUX_BANKS > HAL_MUX_BANKS
+#error "ribbon.h uses more multiplexer banks than the board has"
+#endif
+#if RIBBON_BYTES > DISPLAY_BYTES
+#error "The ribbon is taller than the display"
+#endif
+
+/* The ribbon is centered vertically.  This is the byte of each column of the
+ * video buffer that its first row goes in. */
+#define RIBBON_TOP ((DISPLAY_BYTES - RIBBON_BYTES) / 2)
+
+
+/* Run-time performance counters, shown after the uptimes on the Info screen so
+ * a slow unit can be looked into without a debugger.  Stages are timed with
+ * the profiling timer, PROF_TICK_CYCLES a tick, which is extended past its 8
+ * bits by counting overflows.  Each stage keeps an average of its recent
+ * runs.
+ *
+ * The overflow interrupt also samples interrupt latency, since the count
+ * when it's entered is how long it was held off for.  Only interrupts
+ * disabled or another handler running can hold it off, and the same goes
+ * for the encoder's interrupts, which also come first when both are
+ * waiting.  So its worst case bounds theirs.
+ *
+ * Build with DEFS=-DDIAGNOSTICS=0 to leave all of this out. */
+#ifndef DIAGNOSTICS
+#define DIAGNOSTICS 1
+#endif
+
+#define PROF_TICK_CYCLES 128
+
+/* Stages timed.  Rendering is a whole frame, which includes the blits.
+ * Sending a frame to the VFD and writing a batch of queued EEPROM writes are
+ * timed from start to finish, waiting included. */
+enum { PROF_RENDER, PROF_BLIT, PROF_SPI, PROF_EEPROM, PROF_STAGES };
+
+/* Each stage's average, in sixteenths of a tick. */
+static uint32_t prof_avg[PROF_STAGES];
+/* Overflows of the profiling timer. */
+volatile static uint32_t prof_high = 0;
+/* Worst interrupt latency seen, in ticks. */
+volatile static uint8_t prof_latency_max = 0;
+/* Frames drawn this second, and the most in any one second. */
+volatile static uint8_t prof_frames = 0;
+volatile static uint8_t prof_fps_max = 0;
+/* Encoder changes with both pins changed at once, so a step was missed. */
+volatile static uint16_t prof_enc_dropped = 0;
+volatile static uint32_t prof_eeprom_writes = 0;
+/* When the frame being sent and the EEPROM writes queued were started, and
+ * when the VFD's queue last ran dry. */
+static uint32_t prof_push_start = 0;
+volatile static uint32_t prof_push_end = 0;
+volatile static uint32_t prof_eeprom_start = 0;
+
+ISR(TIMER2_OVF_vect)
 {
-	/* Set /SS, SCK, and MOSI to output. */
-	DDRB |= (1 << PB2) | (1 << PB1) | (1 << PB0);
-	/* The AVR SPI system will not drive /SS when it is
-	 * set as an output, so set it here in order to select
-	 * the device. */
-	PORTB &= ~(1 << PB0);
+	uint8_t late = hal_prof_count();
 
-	/* Enable SPI master mode, double speed. */
-	SPCR = (1 << SPE) | (1 << MSTR) | (1 << SPI2X);
+	if (late > prof_latency_max)
+		prof_latency_max = late;
+	prof_high++;
 }
 
-static void
-spi_send(unsigned char data)
+static uint32_t
+prof_now(void)
 {
-	SPDR = data;
-	while (!(SPSR & (1 << SPIF))) {
-	}
+	/* Read the profiling timer, in ticks, with interrupts disabled.  An
+	 * overflow its interrupt hasn't counted yet shows up as the flag set
+	 * with the count just past 0. */
+	uint32_t high;
+	uint8_t count;
+
+	if (!DIAGNOSTICS)
+		return 0;
+	high = prof_high;
+	count = hal_prof_count();
+	if (hal_prof_overflow() && (count < 0x80))
+		high++;
+	return (high << 8) | count;
 }
 
+static uint32_t
+prof_time(void)
+{
+	/* prof_now(), from the main loop. */
+	uint32_t t;
+
+	cli();
+	t = prof_now();
+	sei();
+	return t;
+}
 
 static void
-vfd_wait_busy(void)
+prof_record(uint8_t stage, uint32_t ticks)
 {
-	/* Poll the VFD's busy pin. */
-	while (!(PINC & (1 << PC0))) {
-	}
+	/* Fold a run of a stage into its average, which starts from the
+	 * first run. */
+	if (!DIAGNOSTICS)
+		return;
+	if (prof_avg[stage] == 0)
+		prof_avg[stage] = ticks << 4;
+	else
+		prof_avg[stage] += ticks - (prof_avg[stage] >> 4);
 }
 
+
+/* Bytes of overhead for each vfd_write_bit_image() call. */
+#define VFD_BIT_IMAGE_HEADER 13
+
+/* While the VFD is busy, poll its busy pin VFD_BUSY_RETRY microseconds
+ * later, doubling the wait each time it's still busy up to
+ * VFD_BUSY_RETRY_MAX.  Each poll is an interrupt costing the order of 100
+ * cycles, so a fixed short period would leave the main loop next to nothing
+ * through the long busy spells, such as the VFD's reset and after a scroll,
+ * while the short spells after each byte still get a quick retry. */
+#define VFD_BUSY_RETRY 16
+#define VFD_BUSY_RETRY_MAX 128
+
 static void
-vfd_wait_notbusy(void)
+vfd_wait_busy(void)
 {
 	/* Poll the VFD's busy pin. */
-	while ((PINC & (1 << PC0))) {
+	while (!hal_vfd_busy()) {
+		hal_idle();
 	}
 }
 
 static void
 vfd_init(void)
 {
-	/* Set the VFD reset pin to output. */
-	DDRC = (1 << PC1);
+	hal_vfd_reset_init();
 	/* Reset VFD with a falling edge on the reset line,
 	 * followed by a rising edge 2 ms later.*/
-	PORTC = (1 << PC1); /* Reset high. */
-	spi_init();
-	PORTC = 0x00; /* Reset low. */
-	_delay_ms(2);
-	PORTC = (1 << PC1); /* Reset high. */
-
-	/* Wait for the VFD to initialize. */
+	hal_vfd_reset(1); /* Reset high. */
+	hal_spi_init();
+	hal_vfd_reset(0); /* Reset low. */
+	hal_delay_ms(2);
+	hal_vfd_reset(1); /* Reset high. */
+
+	/* Wait for the VFD to start initializing, but not for it to finish.
+	 * The queue holds anything sent until it isn't busy any more, so the
+	 * rest of starting up carries on in the meantime. */
 	vfd_wait_busy();
-	vfd_wait_notbusy();
-	_delay_us(2);
+
+	/* Timer 0 polls the busy pin while waiting to send. */
+	hal_vfd_retry_init();
+}
+
+
+/* Writes to the VFD are queued and shifted out by the SPI interrupt so that
+ * the main loop can render the next frame in the meantime.  Each transfer in
+ * the queue is a short command stored in the queue itself, followed by an
+ * optional run of data bytes sent straight from the caller's buffer.  The
+ * caller must leave that buffer alone until vfd_wait_idle() returns. */
+#define VFD_QUEUE_LEN 16 /* Must be a power of 2. */
+
+struct vfd_xfer {
+	uint8_t cmd[VFD_BIT_IMAGE_HEADER];
+	uint8_t cmd_len;
+	const uint8_t *data;
+	uint16_t data_len;
+};
+
+static struct vfd_xfer vfd_queue[VFD_QUEUE_LEN];
+/* The main loop adds transfers at vfd_head and the ISR removes them at
+ * vfd_tail. */
+volatile static uint8_t vfd_head = 0;
+volatile static uint8_t vfd_tail = 0;
+/* Number of bytes of the transfer at vfd_tail already sent. */
+static uint16_t vfd_sent = 0;
+/* Set while the SPI and timer 0 interrupts are working through the queue. */
+volatile static uint8_t vfd_sending = 0;
+/* Microseconds until the next poll of the busy pin. */
+static uint8_t vfd_retry_us = VFD_BUSY_RETRY;
+
+static void
+vfd_tx_next(void)
+{
+	/* Send the next queued byte.  Only called with interrupts disabled,
+	 * either from the ISRs below or to start things off from
+	 * vfd_queue_xfer_end(). */
+	struct vfd_xfer *x;
+	uint8_t data;
+
+	if (vfd_tail == vfd_head) {
+		vfd_sending = 0;
+		hal_mark(MARK_FRAME_PUSH | MARK_END);
+		prof_push_end = prof_now();
+		return;
+	}
+
+	if (hal_vfd_busy()) {
+		/* The VFD is busy, so try again in a bit, and a bit longer
+		 * after that. */
+		hal_vfd_retry_arm(vfd_retry_us);
+		if (vfd_retry_us < VFD_BUSY_RETRY_MAX)
+			vfd_retry_us <<= 1;
+		return;
+	}
+	vfd_retry_us = VFD_BUSY_RETRY;
+
+	x = &vfd_queue[vfd_tail];
+	if (vfd_sent < x->cmd_len)
+		data = x->cmd[vfd_sent];
+	else
+		data = x->data[vfd_sent - x->cmd_len];
+
+	if (++vfd_sent >= x->cmd_len + x->data_len) {
+		vfd_sent = 0;
+		vfd_tail = (vfd_tail + 1) & (VFD_QUEUE_LEN - 1);
+	}
+
+	hal_spi_write(data);
+}
+
+ISR(SPI_STC_vect)
+{
+	vfd_tx_next();
+}
+
+ISR(TIMER0_COMPA_vect)
+{
+	hal_vfd_retry_disarm();
+	vfd_tx_next();
+}
+
+static struct vfd_xfer *
+vfd_queue_xfer_begin(void)
+{
+	/* Return the next free transfer in the queue, waiting for the ISR to
+	 * make room if necessary. */
+	while (((vfd_head + 1) & (VFD_QUEUE_LEN - 1)) == vfd_tail) {
+		hal_idle();
+	}
+	return &vfd_queue[vfd_head];
 }
 
 static void
-vfd_write_byte(unsigned char data)
+vfd_queue_xfer_end(void)
 {
-	vfd_wait_notbusy();
-	spi_send(data);
+	/* Commit the transfer returned by vfd_queue_xfer_begin() and start
+	 * the ISR on it if the queue had drained. */
+	cli();
+	vfd_head = (vfd_head + 1) & (VFD_QUEUE_LEN - 1);
+	if (!vfd_sending) {
+		vfd_sending = 1;
+		vfd_tx_next();
+	}
+	sei();
 }
 
 static void
-vfd_write(const unsigned char *data, int len)
+vfd_wait_idle(void)
 {
-	while (len--)
-		vfd_write_byte(*(data++));
+	/* Wait until everything queued has been sent. */
+	while (vfd_sending) {
+		hal_idle();
+	}
 }
 
 static void
 vfd_write_bit_image(uint16_t left, uint16_t top,
                     uint16_t width, uint16_t height, const uint8_t *data)
 {
-	vfd_write_byte(0x1f);
-	vfd_write_byte(0x28);
-	vfd_write_byte(0x64);
-	vfd_write_byte(0x21);
-	vfd_write_byte(left & 0x0ff);
-	vfd_write_byte(left >> 8);
-	vfd_write_byte(top & 0x0ff);
-	vfd_write_byte(top >> 8);
-	vfd_write_byte(width & 0x0ff);
-	vfd_write_byte(width >> 8);
-	vfd_write_byte(height & 0x0ff);
-	vfd_write_byte(height >> 8);
-	vfd_write_byte(1); /* display information (fixed) */
-	vfd_write(data, width * height / 8);
+	struct vfd_xfer *x = vfd_queue_xfer_begin();
+
+	x->cmd[0] = 0x1f;
+	x->cmd[1] = 0x28;
+	x->cmd[2] = 0x64;
+	x->cmd[3] = 0x21;
+	x->cmd[4] = left & 0x0ff;
+	x->cmd[5] = left >> 8;
+	x->cmd[6] = top & 0x0ff;
+	x->cmd[7] = top >> 8;
+	x->cmd[8] = width & 0x0ff;
+	x->cmd[9] = width >> 8;
+	x->cmd[10] = height & 0x0ff;
+	x->cmd[11] = height >> 8;
+	x->cmd[12] = 1; /* display information (fixed) */
+	x->cmd_len = VFD_BIT_IMAGE_HEADER;
+	x->data = data;
+	x->data_len = width * height / 8;
+
+	vfd_queue_xfer_end();
 }
 
 static void
 vfd_brightness(unsigned char n)
 {
-	vfd_write_byte(0x1f);
-	vfd_write_byte(0x58);
-	vfd_write_byte(n);
+	/* The main loop sets the brightness on every pass, so only bother the
+	 * VFD when it actually changes. */
+	static unsigned char current = 0xff;
+	struct vfd_xfer *x;
+
+	if (n == current)
+		return;
+	current = n;
+
+	x = vfd_queue_xfer_begin();
+	x->cmd[0] = 0x1f;
+	x->cmd[1] = 0x58;
+	x->cmd[2] = n;
+	x->cmd_len = 3;
+	x->data_len = 0;
+	vfd_queue_xfer_end();
+}
+
+static void
+vfd_display_power(uint8_t on)
+{
+	/* Turn the display off or back on.  Display memory is kept. */
+	struct vfd_xfer *x = vfd_queue_xfer_begin();
+
+	x->cmd[0] = 0x1f;
+	x->cmd[1] = 0x28;
+	x->cmd[2] = 0x61;
+	x->cmd[3] = 0x40;
+	x->cmd[4] = on;
+	x->cmd_len = 5;
+	x->data_len = 0;
+	vfd_queue_xfer_end();
+}
+
+
+/* The VFD shows DISPLAY_WIDTH columns of a display memory VFD_MEMORY_WIDTH
+ * columns wide, starting at vfd_start, and the scroll command moves the start
+ * along, wrapping around the end of the memory.  With VFD_HW_SCROLL, when the
+ * ribbon moves the VFD is scrolled to match, so that only the columns coming
+ * into view have to be sent rather than the whole frame.  Bit image writes go
+ * to wherever the display columns are in memory.
+ *
+ * The ribbon is wider than the display memory, so it can't be kept there as
+ * a whole.  Instead the memory holds whatever is on the display, and each
+ * frame brings in the columns at the edge it's moving towards. */
+#define VFD_MEMORY_WIDTH DISPLAY_MEMORY_WIDTH
+#ifndef VFD_HW_SCROLL
+#define VFD_HW_SCROLL 1
+#endif
+
+static uint16_t vfd_start = 0;
+
+static void
+vfd_scroll(int16_t shift)
+{
+	/* Scroll the display shift columns to the right through display
+	 * memory, or to the left if shift is negative. */
+	struct vfd_xfer *x;
+	uint16_t w;
+
+	if (shift < 0)
+		shift += VFD_MEMORY_WIDTH;
+	vfd_start += shift;
+	if (vfd_start >= VFD_MEMORY_WIDTH)
+		vfd_start -= VFD_MEMORY_WIDTH;
+	/* The shift is in bytes of display memory, DISPLAY_BYTES to a
+	 * column. */
+	w = shift * DISPLAY_BYTES;
+
+	x = vfd_queue_xfer_begin();
+	x->cmd[0] = 0x1f;
+	x->cmd[1] = 0x28;
+	x->cmd[2] = 0x61;
+	x->cmd[3] = 0x10;
+	x->cmd[4] = w & 0x0ff;
+	x->cmd[5] = w >> 8;
+	x->cmd[6] = 1; /* Once, */
+	x->cmd[7] = 0;
+	x->cmd[8] = 0; /* as fast as possible. */
+	x->cmd_len = 9;
+	x->data_len = 0;
+	vfd_queue_xfer_end();
+}
+
+static void
+vfd_write_columns(display_column_t px, display_column_t n, const uint8_t *data)
+{
+	/* Write n columns of a frame, starting at column px of the display,
+	 * to where they are in display memory.  Columns that wrap around the
+	 * end of the memory take a second write. */
+	uint16_t x = vfd_start + px;
+	uint16_t first;
+
+	if (x >= VFD_MEMORY_WIDTH)
+		x -= VFD_MEMORY_WIDTH;
+	if (x + n > VFD_MEMORY_WIDTH) {
+		first = VFD_MEMORY_WIDTH - x;
+		vfd_write_bit_image(x, 0, first, DISPLAY_HEIGHT, data);
+		data += first * DISPLAY_BYTES;
+		n -= first;
+		x = 0;
+	}
+	vfd_write_bit_image(x, 0, n, DISPLAY_HEIGHT, data);
+}
+
+
+/* Changed spans closer together than this many columns are merged, since
+ * resending a few unchanged columns is cheaper than the 13-byte header of
+ * another bit image write. */
+#define VFD_SPAN_MERGE 4
+/* Give up on spans and write the whole frame if more than this many
+ * separate spans have changed. */
+#define VFD_MAX_SPANS 8
+
+static void
+vfd_update(const uint8_t *buf, const uint8_t *shown, int16_t shift)
+{
+	/* Queue a frame from the video buffer, sending only the columns
+	 * that differ from shown, the frame currently on the VFD.  Changed
+	 * columns are gathered into spans which are each written as a separate
+	 * bit image window.  Falls back to writing the full frame when the
+	 * spans would cost as much, or if shown is NULL.
+	 *
+	 * shift is how many columns the ribbon has moved to the left since
+	 * shown.  With VFD_HW_SCROLL the VFD is scrolled by that much first,
+	 * and column px of buf is compared with column px + shift of shown.
+	 *
+	 * buf is sent from the SPI interrupt, so the caller must not touch it
+	 * again until vfd_wait_idle() has returned.  Once it has, buf is what
+	 * the VFD is showing. */
+	display_column_t spans[VFD_MAX_SPANS][2];
+	uint8_t nspans = 0;
+	uint16_t cost = 0;
+	display_column_t px;
+	uint8_t s, i;
+	int16_t n;
+	const uint8_t *a, *b;
+
+	if (!VFD_HW_SCROLL || (shift <= -DISPLAY_WIDTH)
+	    || (shift >= DISPLAY_WIDTH))
+		shift = 0;
+	if (!shown)
+		goto full;
+	if (shift)
+		vfd_scroll(shift);
+
+	for (px = 0; px < DISPLAY_WIDTH; px++) {
+		a = &buf[px * DISPLAY_BYTES];
+		n = px + shift;
+		if ((n >= 0) && (n < DISPLAY_WIDTH)) {
+			/* DISPLAY_BYTES is a constant, so this is unrolled
+			 * into a compare of each byte. */
+			b = &shown[n * DISPLAY_BYTES];
+			for (i = 0; (i < DISPLAY_BYTES) && (a[i] == b[i]); i++)
+				;
+			if (i == DISPLAY_BYTES)
+				continue;
+		}
+
+		if (nspans && ((px - spans[nspans - 1][1]) < VFD_SPAN_MERGE)) {
+			/* Close enough to extend the previous span. */
+			cost += (px + 1 - spans[nspans - 1][1]) * DISPLAY_BYTES;
+			spans[nspans - 1][1] = px + 1;
+		}
+		else {
+			if (nspans == VFD_MAX_SPANS)
+				goto full;
+			spans[nspans][0] = px;
+			spans[nspans][1] = px + 1;
+			nspans++;
+			cost += VFD_BIT_IMAGE_HEADER + DISPLAY_BYTES;
+		}
+		if (cost >= VFD_BIT_IMAGE_HEADER
+		            + DISPLAY_WIDTH * DISPLAY_BYTES)
+			goto full;
+	}
+
+	for (s = 0; s < nspans; s++) {
+		px = spans[s][0];
+		vfd_write_columns(px, spans[s][1] - px,
+		                  &buf[px * DISPLAY_BYTES]);
+	}
+	return;
+
+full:
+	vfd_write_columns(0, DISPLAY_WIDTH, buf);
 }
 
 
 /* EEPROM location to store ribbon position. */
-#define EEPROM_POS_ADDRESS        (void *)0x000
-/* EEPROM location to store uptime data. */
-#define EEPROM_BANK0_ADDRESS      (void *)0x100
-/* EEPROM location to store write validation. */
-#define EEPROM_BANK0_GOOD_ADDRESS (void *)0x002
-/* EEPROM location to store duplicate uptime data. */
-#define EEPROM_BANK1_ADDRESS      (void *)0x200
-/* EEPROM location to store duplicate write validation. */
-#define EEPROM_BANK1_GOOD_ADDRESS (void *)0x003
-
-static void
-eeprom_write_uptime(const uint32_t *uptimes)
-{
-	/* Write uptimes to EEPROM.  Store two copies for redundancy.  Each
-	 * copy has a flag at EEPROM_BANKN_GOOD_ADDRESS that indicates that the
-	 * write was completed.  This is intended to protect against data loss
-	 * in the event that the controller is powered down part of the way
-	 * through this function. */
+#define EEPROM_POS_ADDRESS        0x000
+/* The multiplexer bank and address last switched to, followed by a check
+ * byte, which are put back straight after reset. */
+#define EEPROM_MUX_ADDRESS        0x004
+#define EEPROM_MUX_CHECK          0x5a
+/* Locations of the two copies of the uptimes and their write validation
+ * flags in the layout used before the journal.  These are only read at boot
+ * to carry the uptimes over into a new journal. */
+#define EEPROM_BANK0_ADDRESS      0x100
+#define EEPROM_BANK0_GOOD_ADDRESS 0x002
+#define EEPROM_BANK1_ADDRESS      0x200
+#define EEPROM_BANK1_GOOD_ADDRESS 0x003
+
+/* Writing a byte of EEPROM takes about 3.3 ms, so writes are queued and
+ * carried out by the EE_READY interrupt, which fires whenever the EEPROM is
+ * ready for the next byte.  Each queued write carries up to EE_WRITE_MAX
+ * bytes of data, which are copied into EEPROM skipping bytes that already
+ * match, and the writes are done in the order they were queued. */
+#define EE_QUEUE_LEN 16 /* Must be a power of 2. */
+#define EE_WRITE_MAX 8
+
+struct ee_write {
+	uint16_t addr;
+	uint8_t data[EE_WRITE_MAX];
+	uint8_t len;
+};
+
+static struct ee_write ee_queue[EE_QUEUE_LEN];
+/* The main loop adds writes at ee_head and the ISR removes them at
+ * ee_tail. */
+volatile static uint8_t ee_head = 0;
+volatile static uint8_t ee_tail = 0;
+/* Number of bytes of the write at ee_tail already done. */
+static uint8_t ee_done = 0;
+
+ISR(EE_READY_vect)
+{
+	/* Find the next byte that differs from what's in EEPROM and start
+	 * writing it.  The interrupt fires again when it's done. */
+	struct ee_write *w;
+	uint16_t addr;
+	uint8_t data;
+
+	while (ee_tail != ee_head) {
+		w = &ee_queue[ee_tail];
+		while (ee_done < w->len) {
+			addr = w->addr + ee_done;
+			data = w->data[ee_done];
+			ee_done++;
+			if (hal_eeprom_read_byte(addr) != data) {
+				hal_eeprom_write_start(addr, data);
+				if (DIAGNOSTICS)
+					prof_eeprom_writes++;
+				return;
+			}
+		}
+		ee_done = 0;
+		ee_tail = (ee_tail + 1) & (EE_QUEUE_LEN - 1);
+	}
+
+	/* All done. */
+	hal_eeprom_ready_irq(0);
+	prof_record(PROF_EEPROM, prof_now() - prof_eeprom_start);
+}
+
+static uint8_t
+eeprom_queue_space(void)
+{
+	/* Return the number of writes that can be queued without waiting. */
+	return (ee_tail - ee_head - 1) & (EE_QUEUE_LEN - 1);
+}
+
+static void
+eeprom_queue_write(uint16_t addr, const void *src, uint8_t len)
+{
+	/* Queue a write of len bytes from src to addr, waiting for room in the
+	 * queue if necessary.  The data is copied, so src can be reused right
+	 * away. */
+	struct ee_write *w;
+
+	while (!eeprom_queue_space()) {
+		hal_idle();
+	}
+	w = &ee_queue[ee_head];
+	w->addr = addr;
+	memcpy(w->data, src, len);
+	w->len = len;
+
 	cli();
-	eeprom_update_byte(EEPROM_BANK0_GOOD_ADDRESS, 0);
-	eeprom_update_block(uptimes, EEPROM_BANK0_ADDRESS,
-	                    sizeof(uint32_t) * NUM_INPUTS);
-	eeprom_update_byte(EEPROM_BANK0_GOOD_ADDRESS, 1);
-
-	eeprom_update_byte(EEPROM_BANK1_GOOD_ADDRESS, 0);
-	eeprom_update_block(uptimes, EEPROM_BANK1_ADDRESS,
-	                    sizeof(uint32_t) * NUM_INPUTS);
-	eeprom_update_byte(EEPROM_BANK1_GOOD_ADDRESS, 1);
+	if (ee_tail == ee_head)
+		prof_eeprom_start = prof_now();
+	ee_head = (ee_head + 1) & (EE_QUEUE_LEN - 1);
+	hal_eeprom_ready_irq(1);
 	sei();
 }
 
+static uint8_t
+eeprom_pending(void)
+{
+	/* Return non-zero while any queued writes haven't finished. */
+	return ee_tail != ee_head;
+}
+
 static void
-eeprom_read_uptime(uint32_t *uptimes)
+eeprom_flush(void)
 {
-	/* Read uptime from EEPROM.  Only read a copy if the flag at
-	 * EEPROM_BANKN_GOOD_ADDRESS indicates a complete write. */
-	uint8_t bank0_good = 0, bank1_good = 0;
+	/* Wait for all queued writes to finish, for example before the power
+	 * goes away. */
+	while (eeprom_pending()) {
+		hal_idle();
+	}
+}
+
+
+/* The uptimes are kept in a journal of fixed size records that fills the rest
+ * of the EEPROM.  Records are appended one after the other, wrapping around
+ * at the end, so every cell is written equally often instead of the total
+ * uptime being rewritten in place every minute.
+ *
+ * Each record has a sequence number, a tag, a CRC and a value.  The tag holds
+ * the record kind and the index of the uptime it applies to.  A delta record
+ * adds its value to an uptime, and a checkpoint record sets it.  Checkpoints
+ * are written every JOURNAL_CHECKPOINT_EVERY records as a run of consecutive
+ * records for uptimes 0 to NUM_INPUTS - 1, so that the log never needs to be
+ * read back further than that.  One is started as soon as that many records
+ * have gone by, whenever the main loop next gets to the journal, which after
+ * a power cycle is straight after boot.  The last complete checkpoint must
+ * never be overwritten, so if the power keeps going before a checkpoint can
+ * be written, once JOURNAL_CHECKPOINT_FORCE records have gone by the save
+ * when the power fails writes a checkpoint instead of deltas.  That takes
+ * NUM_INPUTS records, which the hold-up time has room for.
+ *
+ * At boot, the newest record is found by sequence number, and the uptimes
+ * are rebuilt by walking back to the newest complete checkpoint and applying
+ * everything from there on.  The walk stops at the first record that fails
+ * its CRC or is out of sequence, so a record torn by a power loss is simply
+ * treated as the end of the log.
+ *
+ * Deltas are normally only written when the power is failing (see
+ * power_fail()), with a safety save every JOURNAL_INTERVAL minutes in case
+ * the power fail save doesn't get to run. */
+#define JOURNAL_ADDRESS          0x100
+#define JOURNAL_SLOTS            480
+#define JOURNAL_INTERVAL         240
+#define JOURNAL_CHECKPOINT_EVERY 64
+#define JOURNAL_CHECKPOINT_FORCE (JOURNAL_SLOTS / 2)
+
+#define JOURNAL_DELTA      0x00
+#define JOURNAL_CHECKPOINT 0x40
+#define JOURNAL_KIND_MASK  0xc0
+#define JOURNAL_ID_MASK    0x3f
+/* Value of journal_checkpoint_id when no checkpoint is being written. */
+#define JOURNAL_NO_CHECKPOINT 0xff
+
+#if NUM_INPUTS > JOURNAL_ID_MASK + 1
+#error "Too many inputs for the journal's record ids"
+#endif
+
+/* CRC-8 with polynomial 0x07.  The initial value is chosen so that neither
+ * erased nor zeroed EEPROM looks like a valid record. */
+#define JOURNAL_CRC_INIT 0x5a
+
+struct journal_record {
+	uint16_t seq;
+	uint8_t tag;
+	uint8_t crc;
+	uint32_t value;
+};
+
+/* Slot and sequence number of the next record to be written. */
+static uint16_t journal_slot = 0;
+static uint16_t journal_seq = 0;
+/* Uptimes as far as the journal is concerned. */
+static uint32_t journal_base[NUM_INPUTS];
+/* Records written since the last complete checkpoint. */
+static uint16_t journal_since_checkpoint = 0;
+/* Index of the next checkpoint record to write. */
+static uint8_t journal_checkpoint_id = JOURNAL_NO_CHECKPOINT;
+/* Set from starting a new journal until its first checkpoint is queued,
+ * while the old layout is still the only complete copy of the uptimes. */
+static uint8_t journal_importing = 0;
+
+static uint8_t
+journal_crc(const struct journal_record *r)
+{
+	const uint8_t *p = (const uint8_t *)r;
+	uint8_t crc = JOURNAL_CRC_INIT;
+	uint8_t i, b;
+
+	for (i = 0; i < sizeof(*r); i++) {
+		if (p + i == &r->crc)
+			continue;
+		crc ^= p[i];
+		for (b = 0; b < 8; b++) {
+			if (crc & 0x80)
+				crc = (crc << 1) ^ 0x07;
+			else
+				crc <<= 1;
+		}
+	}
+	return crc;
+}
+
+static uint8_t
+journal_read(uint16_t slot, struct journal_record *r)
+{
+	/* Read the record in slot and return non-zero if it's valid. */
+	hal_eeprom_read_block(r, JOURNAL_ADDRESS + slot * sizeof(*r),
+	                      sizeof(*r));
+	return (r->crc == journal_crc(r)) &&
+	       ((r->tag & JOURNAL_ID_MASK) < NUM_INPUTS);
+}
+
+static void
+journal_append(uint8_t tag, uint32_t value)
+{
+	struct journal_record r;
+
+	r.seq = journal_seq++;
+	r.tag = tag;
+	r.value = value;
+	r.crc = journal_crc(&r);
+	eeprom_queue_write(JOURNAL_ADDRESS + journal_slot * sizeof(r),
+	                   &r, sizeof(r));
+
+	if (++journal_slot == JOURNAL_SLOTS)
+		journal_slot = 0;
+	journal_since_checkpoint++;
+}
+
+static uint32_t
+uptime_get(const volatile uint32_t *uptimes, uint8_t t)
+{
+	/* The timer ISR changes the uptimes, so read them with interrupts
+	 * off. */
+	uint32_t value;
 
 	cli();
+	value = uptimes[t];
+	sei();
+	return value;
+}
+
+static uint8_t
+journal_service(const volatile uint32_t *uptimes, uint8_t force)
+{
+	/* Called from the main loop to append any records that are due, or
+	 * with force set to write out every change right away.  This never
+	 * waits for the EEPROM; if the queue is full, the rest is left for
+	 * next time.  Returns non-zero once nothing more is due.
+	 *
+	 * Forcing abandons a checkpoint in progress, since the deltas are
+	 * what matters and the boot scan just replays the partial checkpoint
+	 * records along with them, unless JOURNAL_CHECKPOINT_FORCE records
+	 * have gone by since the last complete one, or there isn't one yet. */
+	static const uint8_t flags_clear[2] = { 0, 0 };
+	uint32_t value;
+	uint8_t t;
+
+	if (force && !journal_importing
+	    && (journal_since_checkpoint < JOURNAL_CHECKPOINT_FORCE))
+		journal_checkpoint_id = JOURNAL_NO_CHECKPOINT;
+	else if ((journal_checkpoint_id == JOURNAL_NO_CHECKPOINT)
+	         && (journal_since_checkpoint >= JOURNAL_CHECKPOINT_EVERY))
+		journal_checkpoint_id = 0;
+
+	/* Finish a checkpoint in progress. */
+	while (journal_checkpoint_id != JOURNAL_NO_CHECKPOINT) {
+		if (!eeprom_queue_space())
+			return 0;
+		t = journal_checkpoint_id;
+		journal_base[t] = uptime_get(uptimes, t);
+		journal_append(JOURNAL_CHECKPOINT | t, journal_base[t]);
+		if (++journal_checkpoint_id == NUM_INPUTS) {
+			journal_checkpoint_id = JOURNAL_NO_CHECKPOINT;
+			journal_since_checkpoint = 0;
+		}
+	}
+
+	/* With the first checkpoint queued, the old layout can go.  Its
+	 * flags are next to each other, so they're cleared in one write,
+	 * which the queue only starts once the checkpoint is written. */
+	if (journal_importing) {
+		if (!eeprom_queue_space())
+			return 0;
+		eeprom_queue_write(EEPROM_BANK0_GOOD_ADDRESS, flags_clear,
+		                   sizeof(flags_clear));
+		journal_importing = 0;
+	}
 
-	bank0_good = eeprom_read_byte(EEPROM_BANK0_GOOD_ADDRESS);
-	bank1_good = eeprom_read_byte(EEPROM_BANK1_GOOD_ADDRESS);
+	if (!force &&
+	    (uptime_get(uptimes, 0) - journal_base[0] < JOURNAL_INTERVAL))
+		return 1;
 
-	if (bank0_good) {
-		eeprom_read_block(uptimes, EEPROM_BANK0_ADDRESS,
-		                  sizeof(uint32_t) * NUM_INPUTS);
+	/* Write a delta for each uptime that has changed.  Each one stands on
+	 * its own, so it doesn't matter if they don't all fit at once. */
+	for (t = 0; t < NUM_INPUTS; t++) {
+		value = uptime_get(uptimes, t);
+		if (value == journal_base[t])
+			continue;
+		if (!eeprom_queue_space())
+			return 0;
+		journal_append(JOURNAL_DELTA | t, value - journal_base[t]);
+		journal_base[t] = value;
 	}
-	else if (bank1_good) {
-		eeprom_read_block(uptimes, EEPROM_BANK1_ADDRESS,
-		                  sizeof(uint32_t) * NUM_INPUTS);
+	return 1;
+}
+
+static uint8_t
+journal_import_bank(uint16_t good_address, uint16_t address)
+{
+	/* Read uptimes from the old fixed layout into journal_base if the
+	 * bank's flag indicates a complete write. */
+	if (hal_eeprom_read_byte(good_address) != 1)
+		return 0;
+	hal_eeprom_read_block(journal_base, address,
+	                      sizeof(uint32_t) * NUM_INPUTS);
+	return 1;
+}
+
+static void
+journal_load(volatile uint32_t *uptimes)
+{
+	/* Rebuild the uptimes from the journal.  This is only called at boot,
+	 * before any writes are queued. */
+	struct journal_record r;
+	uint16_t slot, head = JOURNAL_SLOTS, start = JOURNAL_SLOTS;
+	uint16_t n, count = 0;
+	uint8_t want = NUM_INPUTS - 1;
+	uint8_t t;
+
+	/* Find the newest record. */
+	for (slot = 0; slot < JOURNAL_SLOTS; slot++) {
+		if (!journal_read(slot, &r))
+			continue;
+		if ((head == JOURNAL_SLOTS) ||
+		    ((int16_t)(r.seq - journal_seq) > 0)) {
+			head = slot;
+			journal_seq = r.seq;
+		}
 	}
-	else {
-		sei();
-		return;
+
+	/* Walk back from it to the start of the newest complete
+	 * checkpoint. */
+	if (head != JOURNAL_SLOTS) {
+		slot = head;
+		for (n = 0; n < JOURNAL_SLOTS; n++) {
+			if (!journal_read(slot, &r) ||
+			    (r.seq != (uint16_t)(journal_seq - n)))
+				break;
+			if ((r.tag & JOURNAL_KIND_MASK) == JOURNAL_CHECKPOINT) {
+				t = r.tag & JOURNAL_ID_MASK;
+				if (t != want)
+					want = NUM_INPUTS - 1;
+				if (t == want) {
+					if (want == 0) {
+						start = slot;
+						count = n + 1;
+						break;
+					}
+					want--;
+				}
+			}
+			else {
+				want = NUM_INPUTS - 1;
+			}
+			slot = (slot ? slot : JOURNAL_SLOTS) - 1;
+		}
+		journal_slot = (head + 1 == JOURNAL_SLOTS) ? 0 : head + 1;
+		journal_seq++;
 	}
 
-	if (!bank0_good) {
-		eeprom_update_byte(EEPROM_BANK0_GOOD_ADDRESS, 0);
-		eeprom_update_block(uptimes, EEPROM_BANK0_ADDRESS,
-				    sizeof(uint32_t) * NUM_INPUTS);
-		eeprom_update_byte(EEPROM_BANK0_GOOD_ADDRESS, 1);
+	if (start != JOURNAL_SLOTS) {
+		/* Replay from the checkpoint. */
+		slot = start;
+		for (n = 0; n < count; n++) {
+			journal_read(slot, &r);
+			t = r.tag & JOURNAL_ID_MASK;
+			if ((r.tag & JOURNAL_KIND_MASK) == JOURNAL_CHECKPOINT)
+				journal_base[t] = r.value;
+			else
+				journal_base[t] += r.value;
+			if (++slot == JOURNAL_SLOTS)
+				slot = 0;
+		}
+		journal_since_checkpoint = count - NUM_INPUTS;
 	}
-	if (!bank1_good) {
-		eeprom_update_byte(EEPROM_BANK1_GOOD_ADDRESS, 0);
-		eeprom_update_block(uptimes, EEPROM_BANK1_ADDRESS,
-				    sizeof(uint32_t) * NUM_INPUTS);
-		eeprom_update_byte(EEPROM_BANK1_GOOD_ADDRESS, 1);
+	else {
+		/* No usable journal, so start one, carrying over the uptimes
+		 * from the old layout if there are any.  Both of its banks are
+		 * inside the journal, so the first checkpoint goes in the slots
+		 * just past bank 1, and the old layout is left alone until
+		 * journal_service() has written it.  A power loss before then
+		 * just means doing this again at the next boot. */
+		if (!journal_import_bank(EEPROM_BANK1_GOOD_ADDRESS,
+		                         EEPROM_BANK1_ADDRESS) &&
+		    !journal_import_bank(EEPROM_BANK0_GOOD_ADDRESS,
+		                         EEPROM_BANK0_ADDRESS))
+			memset(journal_base, 0, sizeof(journal_base));
+		journal_slot = (EEPROM_BANK1_ADDRESS + sizeof(journal_base)
+		                - JOURNAL_ADDRESS + sizeof(r) - 1) / sizeof(r);
+		journal_checkpoint_id = 0;
+		journal_importing = 1;
 	}
+
+	cli();
+	for (t = 0; t < NUM_INPUTS; t++)
+		uptimes[t] = journal_base[t];
 	sei();
 }
 
+static void
+eeprom_write_pos(uint16_t pos)
+{
+	eeprom_queue_write(EEPROM_POS_ADDRESS, &pos, sizeof(pos));
+}
+
+static void
+eeprom_write_mux(uint8_t bank, uint8_t address)
+{
+	const uint8_t saved[3] = {
+		bank, address, bank ^ address ^ EEPROM_MUX_CHECK
+	};
+
+	eeprom_queue_write(EEPROM_MUX_ADDRESS, saved, sizeof(saved));
+}
+
+static uint8_t
+eeprom_read_mux(uint8_t *bank, uint8_t *address)
+{
+	/* Read the saved multiplexer bank and address.  Returns 0 if there
+	 * aren't any, or they're for a bank the inputs don't use. */
+	uint8_t check = hal_eeprom_read_byte(EEPROM_MUX_ADDRESS + 2);
+
+	*bank = hal_eeprom_read_byte(EEPROM_MUX_ADDRESS);
+	*address = hal_eeprom_read_byte(EEPROM_MUX_ADDRESS + 1);
+	if (check != (*bank ^ *address ^ EEPROM_MUX_CHECK))
+		return 0;
+	return (*bank < MUX_BANKS) || (*bank == MUX_NONE);
+}
+
 
 /* UI state.  Primarily progresses through
  *   S_MENU => S_STOPPED => S_SELECTED => S_CENTERED.
@@ -221,156 +973,357 @@ volatile static enum {
 	/* Scroll uptimes. */
 } state = S_STOPPED;
 
-/* Scroll the uptime buffer 1 row every SCROLL_DELAY ticks. */
-#define SCROLL_DELAY 4000
+/* Scroll the uptime buffer SCROLL_RATE rows a second, 1 row every
+ * SCROLL_DELAY ticks.  Anything up to FRAME_RATE is shown a row at a time. */
+#define SCROLL_RATE 8
+#define SCROLL_DELAY (31250 / SCROLL_RATE)
+/* After a long stall, skip ahead rather than catching up more than this. */
+#define SCROLL_MAX_ROWS 8
 /* Ticks to wait before transitioning to the next state in the absense of
  * rotary encoder movement. */
 #define STATE_DELAY 32000
+/* With FAST_SWITCH, the input is switched as soon as the knob has been still
+ * for FAST_SWITCH_DELAY ticks (64 ms), to the input the ribbon would have
+ * coasted to, and the ribbon springs it to the center afterwards.  Otherwise
+ * it's switched once the ribbon has stopped, STATE_DELAY has passed and the
+ * logo has been centered. */
+#ifndef FAST_SWITCH
+#define FAST_SWITCH 1
+#endif
+#define FAST_SWITCH_DELAY 2000
+/* Draw at most FRAME_RATE frames a second.  Ticks are 32 us. */
+#define FRAME_RATE 60
+#define FRAME_INTERVAL (31250 / FRAME_RATE)
+
+/* Timer 1 compare A ends state delays, and compare B paces frames.  Both
+ * just set a flag and wake the main loop. */
+volatile static uint8_t deadline_due = 0;
+volatile static uint8_t frame_due = 0;
+/* When the current deadline is, so that periodic ones don't drift. */
+static uint16_t deadline_ticks = 0;
+
+ISR(TIMER1_COMPA_vect)
+{
+	hal_deadline_disarm();
+	deadline_due = 1;
+}
 
-/* The last time a state transtition occurred. */
-volatile static uint16_t last_ticks = 0;
+ISR(TIMER1_COMPB_vect)
+{
+	hal_frame_disarm();
+	frame_due = 1;
+}
 
-/* The currently-selected input. */
-volatile static int8_t input = 0;
+static void
+deadline_set(uint16_t at)
+{
+	/* Set deadline_due at tick at, which must be less than half the
+	 * counter's range away. */
+	deadline_ticks = at;
+	deadline_due = 0;
+	hal_deadline_arm(at);
+	/* If at went by while arming, the compare won't match until the
+	 * counter comes all the way around. */
+	if ((int16_t)(hal_ticks() - at) >= 0) {
+		hal_deadline_disarm();
+		deadline_due = 1;
+	}
+}
 
+static void
+deadline_cancel(void)
+{
+	hal_deadline_disarm();
+	deadline_due = 0;
+}
 
-/* Constants and variables for tracking movement on the ribbon.  Motion of the
- * rotary encoder changes velocity, which determines the amount of period
- * change to the position.  Velocity decays over time. */
+static void
+frame_set(uint16_t at)
+{
+	/* The same for frame_due. */
+	frame_due = 0;
+	hal_frame_arm(at);
+	if ((int16_t)(hal_ticks() - at) >= 0) {
+		hal_frame_disarm();
+		frame_due = 1;
+	}
+}
 
-/* Add velocity to position every POS_INTERVAL ticks. */
-#define POS_INTERVAL 500
-/* Absolute velocity decreases by 3 every VELOCITY_INTERVAL ticks. */
-#define VELOCITY_INTERVAL 4000
-#define VELOCITY_DECAY 3
+/* The currently-selected input. */
+volatile static int8_t input = 0;
 
-/* pos_ticks counts up to POS_INTERVAL. */
-volatile static uint16_t pos_ticks = 0;
-/* velocity_ticks counts up to VELOCITY_INTERVAL. */
-volatile static uint16_t velocity_ticks = 0;
 
-/* Position on the ribbon.  0 <= pos < ribbon_width
+/* Ribbon motion.  Position and velocity are fixed point with 8 fractional
+ * bits, position in columns and velocity in columns per MOTION_STEP ticks.
+ * Motion is advanced in fixed steps of elapsed TCNT1 time, however often the
+ * main loop gets around to it, so it looks the same at any frame rate.
+ *
+ * Knob steps push velocity through motion_accel, and the ribbon coasts to a
+ * stop with exponential friction.  When an input is selected, a critically
+ * damped spring pulls its center to the middle of the display instead, going
+ * the short way around the end of the ribbon. */
+
+/* Ticks per step, 8.192 ms. */
+#define MOTION_STEP 256
+/* After a long stall, give up catching up after this many steps. */
+#define MOTION_MAX_STEPS 32
+/* Velocity loses 1/64 each step, a time constant of about half a second. */
+#define MOTION_FRICTION_SHIFT 6
+/* The ribbon stops below 1/8 column per step. */
+#define MOTION_STOP 0x0020
+#define MOTION_MAX_VELOCITY (10 << 8)
+/* The spring pulls with k = (w * dt)^2 and damps with c = 2 * w * dt, here
+ * with w * dt = 1/4, so it settles in about 30 steps. */
+#define SPRING_K_SHIFT 4
+#define SPRING_C_SHIFT 1
+
+/* Velocity added by a knob step, indexed by the current speed in whole
+ * columns per step, so that spinning faster covers more ground per step. */
+static const int16_t motion_accel[8] = {
+	0x00c0, 0x0100, 0x0140, 0x0180, 0x0200, 0x0280, 0x0300, 0x0400
+};
+
+/* 0 <= motion_x < ribbon_width << 8 */
+static int32_t motion_x = 0;
+static int16_t motion_v = 0;
+/* Column the spring is pulling toward, or -1 to coast. */
+static int16_t motion_target = -1;
+/* Ticks up to which motion has been worked out. */
+static uint16_t motion_ticks = 0;
+
+/* Position on the ribbon, the whole part of motion_x.  0 <= pos < ribbon_width
  * 0 is the left-most column. */
-volatile static int16_t pos = 0;
-/* Velocity of ribbon movement.  -20 < velocity < 20 Positive
- * velocity moves position to the right, negative velocity
- * moves position to the left. */
-volatile static int8_t velocity = 0;
+static int16_t pos = 0;
 
+static int32_t
+motion_wrap(int32_t x)
+{
+	/* Wrap a position back onto the ribbon, from up to one ribbon width
+	 * either side. */
+	const int32_t width = (int32_t)ribbon_width << 8;
+
+	if (x < 0)
+		x += width;
+	else if (x >= width)
+		x -= width;
+	return x;
+}
 
-enum enc_dir { ENC_DIR_LEFT, ENC_DIR_RIGHT };
-volatile static enum enc_dir enc_dir_1 = ENC_DIR_LEFT;
-volatile static enum enc_dir enc_dir_0 = ENC_DIR_RIGHT;
-
-/* Shortcuts for setting interrupt trigger conditions in EICRA. */
-#define ENC_INT_1_RISE ((1 << ISC11) | (1 << ISC10))
-#define ENC_INT_1_FALL ((1 << ISC11)               )
-#define ENC_INT_0_RISE ((1 << ISC01) | (1 << ISC00))
-#define ENC_INT_0_FALL ((1 << ISC01)               )
+static int32_t
+motion_offset(void)
+{
+	/* Signed distance from motion_target to motion_x the short way
+	 * around. */
+	const int32_t width = (int32_t)ribbon_width << 8;
+	int32_t d = motion_x - ((int32_t)motion_target << 8);
+
+	if (d > width / 2)
+		d -= width;
+	else if (d < -width / 2)
+		d += width;
+	return d;
+}
 
 static void
-encoder_init()
+motion_set(int16_t column)
 {
-	/* Set up encoder ports and interrupts.  This needs to be called every
-	 * time the encoder value changes to configure the interrupt triggers
-	 * and directions. */
+	/* Put the ribbon at rest at column. */
+	motion_x = (int32_t)column << 8;
+	motion_v = 0;
+	motion_target = -1;
+	pos = column;
+}
 
-	/* Configure PD0 and PD1 as inputs */
-	DDRD &= ~(1 << PD0);
-	DDRD &= ~(1 << PD1);
+static void
+motion_impulse(int8_t dir)
+{
+	/* Apply a knob step in direction dir.  From rest, a step also moves
+	 * by exactly one column, so slow turns are precise. */
+	uint8_t speed = abs(motion_v) >> 8;
+
+	if (speed > 7)
+		speed = 7;
+	if (motion_v == 0)
+		motion_x = motion_wrap(motion_x + dir * 256);
+	motion_v += dir * motion_accel[speed];
+	if (motion_v > MOTION_MAX_VELOCITY)
+		motion_v = MOTION_MAX_VELOCITY;
+	else if (motion_v < -MOTION_MAX_VELOCITY)
+		motion_v = -MOTION_MAX_VELOCITY;
+	motion_target = -1;
+	pos = motion_x >> 8;
+}
 
-	/* Enable the pull-up resistors */
-	PORTD |= (1 << PD0) | (1 << PD1);
+static void
+motion_update(uint16_t now)
+{
+	/* Advance the motion to now. */
+	uint8_t steps = 0;
+	int16_t speed;
 
-	/* PD1:PD0 goes 00 => 01 => 11 => 10 => 00 from left to right, so... */
+	while ((uint16_t)(now - motion_ticks) >= MOTION_STEP) {
+		if (++steps > MOTION_MAX_STEPS) {
+			motion_ticks = now;
+			break;
+		}
+		motion_ticks += MOTION_STEP;
 
-	/* PP  Configure interrupts based on current encoder value.
-	 * DD  enc_dir_1 and enc_dir_0 are passed from the ISRs to
-	 * 10  encoder_interrupt().
-	 * --
-	 * 00: PD1 rise means left, PD0 rise means right
-	 * 01: PD0 fall means left, PD1 rise means right
-	 * 11: PD1 fall means left, PD0 fall means right
-	 * 10: PD0 rise means left, PD1 fall means right
-	 * */
-	uint8_t d = PIND & 0x03;
-        if (d == 0x00) {
-		EICRA = ENC_INT_1_RISE | ENC_INT_0_RISE;
-		enc_dir_1 = ENC_DIR_LEFT;
-		enc_dir_0 = ENC_DIR_RIGHT;
-	}
-	else if (d == 0x01) {
-		EICRA = ENC_INT_1_RISE | ENC_INT_0_FALL;
-		enc_dir_1 = ENC_DIR_RIGHT;
-		enc_dir_0 = ENC_DIR_LEFT;
-	}
-	else if (d == 0x03) {
-		EICRA = ENC_INT_1_FALL | ENC_INT_0_FALL;
-		enc_dir_1 = ENC_DIR_LEFT;
-		enc_dir_0 = ENC_DIR_RIGHT;
+		if (motion_target >= 0) {
+			motion_v -= (motion_offset() >> SPRING_K_SHIFT)
+			            + (motion_v >> SPRING_C_SHIFT);
+		}
+		else {
+			/* Friction takes a fraction of the speed, plus one so
+			 * that it gets down to MOTION_STOP. */
+			speed = abs(motion_v);
+			speed -= (speed >> MOTION_FRICTION_SHIFT) + 1;
+			if (speed < MOTION_STOP)
+				speed = 0;
+			motion_v = (motion_v < 0) ? -speed : speed;
+		}
+		motion_x = motion_wrap(motion_x + motion_v);
 	}
-	else if (d == 0x02) {
-		EICRA = ENC_INT_1_FALL | ENC_INT_0_RISE;
-		enc_dir_1 = ENC_DIR_RIGHT;
-		enc_dir_0 = ENC_DIR_LEFT;
+	pos = motion_x >> 8;
+}
+
+static int16_t
+motion_rest(void)
+{
+	/* Work out the column the ribbon would coast to a stop at, the same
+	 * way motion_update() would get there. */
+	int32_t x = motion_x;
+	int16_t speed = abs(motion_v);
+
+	while (speed) {
+		speed -= (speed >> MOTION_FRICTION_SHIFT) + 1;
+		if (speed < MOTION_STOP)
+			speed = 0;
+		x = motion_wrap(x + ((motion_v < 0) ? -speed : speed));
 	}
+	return x >> 8;
+}
 
-	/* Clear interrupt flags. */
-        EIFR |= (1 << INTF1) | (1 << INTF0);
-	/* Enable interrupts on both encoder pins. */
-	EIMSK |= (1 << INT0) | (1 << INT1);
+static uint8_t
+motion_moving(void)
+{
+	return (motion_v != 0) || (motion_target >= 0);
 }
 
-static void
-encoder_interrupt(enum enc_dir dir)
+static uint8_t
+motion_settled(void)
 {
-	/* Called when a rotary encoder interrupt has occurred.  The interrupt
-	 * vector supplies the direction set by encoder_init(). */
+	/* Return non-zero once the spring has all but come to rest on
+	 * motion_target. */
+	return (labs(motion_offset()) < 0x80) && (abs(motion_v) < MOTION_STOP);
+}
 
-	/* Transition to the menu state and update pos and velocity. */
-	if (dir == ENC_DIR_LEFT) {
-		state = S_MENU;
 
-		if (velocity == 0) {
-			pos += -1;
-			if (pos < 0)
-				pos = ribbon_width + pos;
-		}
-		if (velocity > -20)
-			velocity -= VELOCITY_DECAY;
-        }
-        else {
-		state = S_MENU;
+/* The encoder interrupts fire on every change of either pin, and the ISR looks
+ * up the previous and current pin states in enc_table to get a step of -1, 0
+ * or +1.  Changes that don't follow the Gray sequence, such as both pins
+ * changing at once or a pin bouncing back before the ISR ran, are treated
+ * as no step.
+ *
+ * Steps are passed to the main loop through enc_queue, which the ISR is the
+ * only writer of at enc_head and the main loop the only reader of at enc_tail,
+ * so neither needs to disable interrupts.  If the queue is full, steps are
+ * held in enc_steps and go out with the next event. */
+#define ENC_QUEUE_LEN 16 /* Must be a power of 2. */
+
+/* Indexed by previous PD1:PD0 << 2 | current PD1:PD0.  PD1:PD0 goes
+ * 00 => 01 => 11 => 10 => 00 from left to right. */
+static const int8_t enc_table[16] = {
+	 0, +1, -1,  0,
+	-1,  0,  0, +1,
+	+1,  0,  0, -1,
+	 0, -1, +1,  0
+};
+
+static int8_t enc_queue[ENC_QUEUE_LEN];
+volatile static uint8_t enc_head = 0;
+volatile static uint8_t enc_tail = 0;
+/* Pin state as of the last interrupt. */
+static uint8_t enc_pins = 0;
+/* Steps not queued yet. */
+static int8_t enc_steps = 0;
 
-		if (velocity == 0) {
-			pos += 1;
-			pos = pos % ribbon_width;
-		}
-		if (velocity < 20)
-			velocity += VELOCITY_DECAY;
-        }
-	/* Reinitialize encoder interrupts based on new encoder value. */
-	encoder_init();
+static void
+encoder_init()
+{
+	/* Configure PD0 and PD1 as inputs with pull-ups, and interrupt on any
+	 * change of either. */
+	hal_encoder_init();
+	enc_pins = hal_encoder_read();
+	hal_encoder_arm(ENC_INT_1_ANY | ENC_INT_0_ANY);
+}
+
+static void
+encoder_interrupt(void)
+{
+	/* Called when either encoder pin has changed. */
+	uint8_t pins = hal_encoder_read();
+	uint8_t next;
+
+	enc_steps += enc_table[(enc_pins << 2) | pins];
+	if (DIAGNOSTICS && ((enc_pins ^ pins) == 0x03))
+		prof_enc_dropped++;
+	enc_pins = pins;
+	if (enc_steps == 0)
+		return;
+
+	next = (enc_head + 1) & (ENC_QUEUE_LEN - 1);
+	if (next == enc_tail)
+		return;
+	enc_queue[enc_head] = enc_steps;
+	enc_head = next;
+	enc_steps = 0;
 }
 
 ISR(INT0_vect)
 {
-        encoder_interrupt(enc_dir_0);
+        encoder_interrupt();
 }
 
 ISR(INT1_vect)
 {
-        encoder_interrupt(enc_dir_1);
+        encoder_interrupt();
+}
+
+static void
+encoder_poll(void)
+{
+	/* Apply the queued encoder steps.  Any step transitions to the menu
+	 * state, and with FAST_SWITCH starts the wait for the knob to be
+	 * still. */
+	int8_t steps;
+
+	while (enc_tail != enc_head) {
+		steps = enc_queue[enc_tail];
+		enc_tail = (enc_tail + 1) & (ENC_QUEUE_LEN - 1);
+
+		state = S_MENU;
+		if (FAST_SWITCH)
+			deadline_set(hal_ticks() + FAST_SWITCH_DELAY);
+		else
+			deadline_cancel();
+		for (; steps < 0; steps++)
+			motion_impulse(-1);
+		for (; steps > 0; steps--)
+			motion_impulse(1);
+	}
 }
 
 
 /* Uptimes for each input.  The first input (info) represents the total uptime.
- * These are incremented by the timer ISR, written to EEPROM periodically, and
- * read back from EEPROM at boot.  */
+ * These are incremented by the timer ISR, recorded in the EEPROM journal
+ * periodically, and rebuilt from the journal at boot.  */
 volatile static uint32_t uptimes[NUM_INPUTS] = { 0 };
-/* Set when times are updated by the timer ISR so that the uptime scroll can be
- * redisplayed. */
-volatile static uint8_t uptimes_dirty = 1;
+/* Bits set by the timer ISR for each uptime it updates, indexed by id, so that
+ * those lines of the uptime scroll can be redrawn.  uptimes_dirty is set along
+ * with them. */
+#define UPTIME_MASK_BYTES (((NUM_INPUTS) + 7) / 8)
+volatile static uint8_t uptimes_changed[UPTIME_MASK_BYTES];
+volatile static uint8_t uptimes_dirty = 0;
 
 /* These are used to dim the display after a certain amount of time is spent
  * on the same input. */
@@ -382,231 +1335,1116 @@ static void
 init_uptime_counter()
 {
 	/* Fire an interrupt every 1 second. */
-	TCCR3A = 0;
-	TCCR3B |= _BV(WGM32) | _BV(CS32); /* CTC, CLK / 256*/
-	TCNT3 = 0;
-	/* Timer compare interrupt */
-	OCR3A = 31250;
-	TIMSK3 |= 1 << OCIE3A;
+	hal_seconds_init();
 }
 
 ISR(TIMER3_COMPA_vect)
 {
 	static uint8_t seconds = 0;
+	uint8_t id;
+	hal_seconds_next();
 	seconds++;
+	if (prof_frames > prof_fps_max)
+		prof_fps_max = prof_frames;
+	prof_frames = 0;
 	if (seconds >= 60) {
 		seconds = 0;
 		uptimes[0]++;
-		if ((state == S_CENTERED) && (inputs[input].address != 0xff)) {
+		uptimes_changed[0] |= 1;
+		if ((state == S_CENTERED)
+		    && (pgm_read_byte(&inputs[input].bank) != MUX_NONE)) {
+			id = pgm_read_byte(&inputs[input].id);
 			minutes_this_input++;
-			uptimes[input]++;
+			uptimes[id]++;
+			uptimes_changed[id >> 3] |= 1 << (id & 7);
 		}
 		uptimes_dirty = 1;
 	}
 }
 
 
+/* Power fail handling.  The analog comparator trips when the supply starts to
+ * drop, and the bulk capacitor then has to keep the controller going for
+ * long enough for the uptimes to be saved.  The display is turned off
+ * first, since it draws far more than the controller.
+ *
+ * Whatever is already in the EEPROM queue is written first, and the queue
+ * can be full when the comparator trips, for example with a checkpoint
+ * still going out.  That's up to EE_QUEUE_LEN - 1 writes of EE_WRITE_MAX
+ * bytes (15 * 8 bytes), and a byte already in progress.  The save itself is
+ * then at most a record for every input (11 * 8 bytes), either deltas or
+ * the rest of a checkpoint, so the worst case is 209 bytes, at about 3.4 ms
+ * a byte, which is 710 ms.  Normally the queue is empty and only the total
+ * and the current input have changed, which is 16 bytes, or about 55 ms.
+ * The capacitor needs to be at least
+ *   C = I * t / (V_trip - V_dropout)
+ * so with 15 mA for the controller, 710 ms and 2.5 V between the trip point
+ * and the regulator dropping out, about 4300 uF, so 4700 uF. */
+
+/* Set by the comparator ISR, handled by the main loop. */
+volatile static uint8_t power_failing = 0;
+
+ISR(ANALOG_COMP_vect)
+{
+	power_failing = 1;
+}
+
 static void
-render_uptime_line(uint8_t *dst, const char *s)
+power_init(void)
 {
-	int c, i;
-	for (c = 0; c < 9; c++) {
-		if (!s[c])
-			break;
-		/* Characters are 5 pixels wide.  Only use /[0-9][A-Z]dhm/
-		 * font[] is ordered:
-		 * ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789dhms */
-		for (i = 0; i < 5; i++) {
-			if ((s[c] >= '0') && (s[c] <= '9'))
-				dst[c*5+i] = font[s[c]-'0'][i];
-			else if ((s[c] >= 'A') && (s[c] <= 'Z'))
-				dst[c*5+i] = font[s[c]-'A'+10][i];
-			else if (s[c] == 'd')
-				dst[c*5+i] = font[36][i];
-			else if (s[c] == 'h')
-				dst[c*5+i] = font[37][i];
-			else if (s[c] == 'm')
-				dst[c*5+i] = font[38][i];
+	hal_power_init();
+	/* The comparator only interrupts on a change, so catch a supply that
+	 * is already low. */
+	if (hal_power_low())
+		power_failing = 1;
+}
+
+static void
+power_fail(void)
+{
+	/* Save everything before the power goes away. */
+	vfd_display_power(0);
+	while (!journal_service(uptimes, 1)) {
+		hal_idle();
+	}
+	eeprom_flush();
+
+	/* If it was only a brownout and the supply recovers, carry on. */
+	while (hal_power_low()) {
+		hal_idle();
+	}
+	power_failing = 0;
+	vfd_display_power(1);
+}
+
+
+/* Glyph in font[] for each character from GLYPH_FIRST to GLYPH_LAST, or
+ * GLYPH_NONE for characters the font doesn't have, which are left blank.
+ * font[] has 0-9, A-Z and then d, h, m and s. */
+#define GLYPH_FIRST ' '
+#define GLYPH_LAST  'z'
+#define GLYPH_NONE  0xff
+static const uint8_t glyph_index[GLYPH_LAST - GLYPH_FIRST + 1] PROGMEM = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10,
+	0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+	0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20,
+	0x21, 0x22, 0x23, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0x24, 0xff, 0xff, 0xff,
+	0x25, 0xff, 0xff, 0xff, 0xff, 0x26, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0x27, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff,
+};
+
+/* The uptime text scrolled through the Info window is two empty lines for
+ * spacing, followed by two lines for each input, its name and then its uptime.
+ * With DIAGNOSTICS, the performance counters follow in the same way after two
+ * more empty lines, a label and then a value for each.  Only the lines the
+ * window is drawn from are kept rendered, in a ring of UPTIME_RING lines, so
+ * the buffer is the same size however many inputs there are.
+ *
+ * The buffer is column-major like the video buffer, but each column runs the
+ * height of the ring, a byte for each line of 8 rows.  Counting lines from the
+ * top of the text, and on past the end while the window wraps around to the
+ * start, line n is kept in slot n % UPTIME_RING.  The first UPTIME_SEAM slots
+ * are repeated after the last, so the bytes that make up any window, which is
+ * the height of the ribbon, plus the row being shifted in can be read
+ * straight from a column without wrapping around. */
+#define UPTIME_INPUT_LINES (2 * (NUM_INPUTS) + 2)
+#define UPTIME_LINES (UPTIME_INPUT_LINES + (DIAGNOSTICS ? DIAG_LINES : 0))
+#define UPTIME_ROWS (UPTIME_LINES * 8)
+#define UPTIME_RING 8
+#define UPTIME_SEAM RIBBON_BYTES
+#define UPTIME_STRIDE (UPTIME_RING + UPTIME_SEAM)
+/* Each line is 40 columns, room for 8 characters. */
+#define UPTIME_COLUMNS 40
+#define UPTIME_LINE_CHARS 8
+
+/* The line of text in each slot of the ring plus one, or 0 for none. */
+static uint8_t uptime_ring[UPTIME_RING];
+
+static void
+render_uptime_line(uint8_t (*ut)[UPTIME_STRIDE], uint8_t slot,
+                   const char *s)
+{
+	/* Render up to UPTIME_LINE_CHARS characters of s into a slot of the
+	 * ring, and its copy past the seam, clearing whatever was there. */
+	uint8_t c, i, g, px, b;
+
+	for (px = 0, c = 0; c < UPTIME_LINE_CHARS; c++) {
+		g = GLYPH_NONE;
+		if (*s) {
+			if ((*s >= GLYPH_FIRST) && (*s <= GLYPH_LAST))
+				g = pgm_read_byte(&glyph_index[*s - GLYPH_FIRST]);
+			s++;
+		}
+		for (i = 0; i < 5; i++, px++) {
+			b = (g == GLYPH_NONE) ? 0 : pgm_read_byte(&font[g][i]);
+			ut[px][slot] = b;
+			if (slot < UPTIME_SEAM)
+				ut[px][slot + UPTIME_RING] = b;
 		}
 	}
 }
 
+/* Uptimes broken down into days, hours and minutes for display.  Each is
+ * brought up to date by adding on the minutes that have passed since, which
+ * is normally just one, so formatting never has to divide. */
+struct uptime_text {
+	uint32_t minutes; /* The uptime this represents. */
+	uint16_t days;
+	uint8_t hours;
+	uint8_t mins;
+};
+
+static struct uptime_text uptime_text[NUM_INPUTS];
+
+/* The counters on the diagnostics page.  Times are in CPU cycles, the stages'
+ * recent averages and the worst interrupt latency, and the stack is the most
+ * of it ever used, in bytes. */
+enum {
+	DIAG_FPS, DIAG_RENDER, DIAG_BLIT, DIAG_SPI, DIAG_EEPROM, DIAG_LATENCY,
+	DIAG_ENC_DROPPED, DIAG_EEPROM_WRITES, DIAG_STACK, DIAG_ITEMS
+};
+#define DIAG_LINES (2 * DIAG_ITEMS + 2)
+
+static const char diag_labels[DIAG_ITEMS][UPTIME_LINE_CHARS + 1] PROGMEM = {
+	"PEAK FPS", "RENDER", "BLIT", "SPI TX", "EEPROM", "IRQ LAT",
+	"ENC DROP", "EE WRITE", "STACK",
+};
+
 static void
-render_uptime(uint8_t *dst, const uint32_t *uptimes)
+uptime_text_advance(struct uptime_text *u, uint32_t minutes)
 {
-	char s[9];
-	uint32_t time;
-	int t;
-	for (t = 0; t < NUM_INPUTS; t++) {
-		render_uptime_line(&dst[80+t*2*40], inputs[t].abbrev);
-		time = uptimes[inputs[t].id];
-		if ((time / 60) >= 100) {
-			sprintf(s, "%2id%2ih",
-			        (short)((time / 60) / 24),
-				(short)((time % (24 * 60)) / 60));
+	uint32_t n = minutes - u->minutes;
+
+	u->minutes = minutes;
+	while (n >= 24 * 60) {
+		n -= 24 * 60;
+		u->days++;
+	}
+	while (n >= 60) {
+		n -= 60;
+		u->hours++;
+	}
+	u->mins += n;
+	if (u->mins >= 60) {
+		u->mins -= 60;
+		u->hours++;
+	}
+	if (u->hours >= 24) {
+		u->hours -= 24;
+		u->days++;
+	}
+}
+
+static char *
+format_digits(char *s, uint16_t n, uint8_t width)
+{
+	/* Write n, up to 9999, in decimal right-aligned in at least width
+	 * characters.  Returns the end of what was written. */
+	static const uint16_t powers[4] = { 1000, 100, 10, 1 };
+	uint8_t p, started = 0;
+	char d;
+
+	for (p = 0; p < 4; p++) {
+		d = '0';
+		while (n >= powers[p]) {
+			n -= powers[p];
+			d++;
+		}
+		if ((d != '0') || (p == 3))
+			started = 1;
+		if (started)
+			*s++ = d;
+		else if ((4 - p) <= width)
+			*s++ = ' ';
+	}
+	return s;
+}
+
+static char *
+format_count(char *s, uint32_t n)
+{
+	/* Write n in decimal, up to UPTIME_LINE_CHARS digits.  Only the
+	 * diagnostics page uses this, which is drawn rarely enough to
+	 * divide. */
+	char d[UPTIME_LINE_CHARS];
+	uint8_t i = 0;
+
+	do {
+		d[i++] = '0' + n % 10;
+		n /= 10;
+	} while (n && (i < UPTIME_LINE_CHARS));
+	while (i)
+		*s++ = d[--i];
+	return s;
+}
+
+static void
+format_diag(char *s, uint8_t item)
+{
+	/* Format one of the diagnostics page's counters. */
+	uint32_t n;
+
+	cli();
+	switch (item) {
+	case DIAG_FPS:
+		n = prof_fps_max;
+		break;
+	case DIAG_RENDER:
+	case DIAG_BLIT:
+	case DIAG_SPI:
+	case DIAG_EEPROM:
+		n = prof_avg[item - DIAG_RENDER] * (PROF_TICK_CYCLES / 16);
+		break;
+	case DIAG_LATENCY:
+		n = (uint32_t)prof_latency_max * PROF_TICK_CYCLES;
+		break;
+	case DIAG_ENC_DROPPED:
+		n = prof_enc_dropped;
+		break;
+	case DIAG_EEPROM_WRITES:
+		n = prof_eeprom_writes;
+		break;
+	default:
+		n = 0;
+	}
+	sei();
+	if (item == DIAG_STACK)
+		n = hal_stack_used();
+	*format_count(s, n) = '\0';
+}
+
+static void
+format_uptime(char *s, const struct uptime_text *u)
+{
+	/* Format an uptime as hours and minutes, or as days and hours once it
+	 * gets to 100 hours. */
+	if ((u->days < 4) || ((u->days == 4) && (u->hours < 4))) {
+		s = format_digits(s, u->days * 24 + u->hours, 2);
+		*s++ = 'h';
+		s = format_digits(s, u->mins, 2);
+		*s++ = 'm';
+	}
+	else {
+		s = format_digits(s, (u->days > 9999) ? 9999 : u->days, 2);
+		*s++ = 'd';
+		s = format_digits(s, u->hours, 2);
+		*s++ = 'h';
+	}
+	*s = '\0';
+}
+
+static void
+render_uptime_text(uint8_t (*ut)[UPTIME_STRIDE],
+                   const volatile uint32_t *uptimes,
+                   uint8_t slot, uint8_t line)
+{
+	/* Render a line of the uptime text into a slot of the ring. */
+	char s[UPTIME_LINE_CHARS + 1];
+	uint8_t t, id;
+
+	s[0] = '\0';
+	if (line >= UPTIME_INPUT_LINES + 2) {
+		t = (line - UPTIME_INPUT_LINES - 2) >> 1;
+		if (line & 1)
+			format_diag(s, t);
+		else
+			memcpy_P(s, diag_labels[t], sizeof(s));
+	}
+	else if ((line >= 2) && (line < UPTIME_INPUT_LINES)) {
+		t = (line - 2) >> 1;
+		if (line & 1) {
+			id = pgm_read_byte(&inputs[t].id);
+			uptime_text_advance(&uptime_text[id],
+			                    uptime_get(uptimes, id));
+			format_uptime(s, &uptime_text[id]);
 		}
 		else {
-			sprintf(s, "%2ih%2im",
-			        (short)(time / 60),
-				(short)(time % 60));
+			memcpy_P(s, inputs[t].abbrev, sizeof(s));
 		}
-		render_uptime_line(&dst[80+t*2*40+40], s);
 	}
+	render_uptime_line(ut, slot, s);
+	uptime_ring[slot] = line + 1;
+}
+
+static void
+render_uptime_window(uint8_t (*ut)[UPTIME_STRIDE],
+                     const volatile uint32_t *uptimes, uint16_t row)
+{
+	/* Make sure the ring holds the RIBBON_BYTES + 1 lines that the window
+	 * starting at row is drawn from.  Normally it's just the one scrolling
+	 * in. */
+	uint8_t n = row >> 3;
+	uint8_t k, line;
+
+	for (k = 0; k < RIBBON_BYTES + 1; k++, n++) {
+		line = (n >= UPTIME_LINES) ? (n - UPTIME_LINES) : n;
+		if (uptime_ring[n & (UPTIME_RING - 1)] != line + 1)
+			render_uptime_text(ut, uptimes,
+			                   n & (UPTIME_RING - 1), line);
+	}
+}
+
+static uint8_t
+render_uptime(uint8_t (*ut)[UPTIME_STRIDE], const volatile uint32_t *uptimes,
+              const uint8_t *changed)
+{
+	/* Re-render any lines in the ring for the uptimes with bits set in
+	 * changed.  Returns whether there were any. */
+	uint8_t slot, line, id, redrawn = 0;
+
+	for (slot = 0; slot < UPTIME_RING; slot++) {
+		line = uptime_ring[slot] - 1;
+		if (!uptime_ring[slot] || (line < 2)
+		    || (line >= UPTIME_INPUT_LINES) || !(line & 1))
+			continue;
+		id = pgm_read_byte(&inputs[(line - 2) >> 1].id);
+		if (changed[id >> 3] & (1 << (id & 7))) {
+			render_uptime_text(ut, uptimes, slot, line);
+			redrawn = 1;
+		}
+	}
+	return redrawn;
 }
 
 
+static void
+ribbon_decode(uint8_t *dst, uint16_t rx, uint16_t n)
+{
+	/* Expand n columns of the ribbon, starting at column rx, into the
+	 * RIBBON_BYTES from RIBBON_TOP of each DISPLAY_BYTES column of dst.
+	 * The rest of each column is left alone.  The columns must not run
+	 * past the end of the ribbon.
+	 *
+	 * The ribbon is stored compressed in flash as a series of tokens, one
+	 * for each run of identical columns.  Each token is a header byte
+	 * followed by the column's non-zero bytes.  The high nibble of the
+	 * header is one less than the length of the run, and the low nibble
+	 * has a bit set for each byte that follows, bit 3 for the top byte.
+	 * Runs never cross a block of 1 << RIBBON_BLOCK_SHIFT columns, and
+	 * ribbon_index[] has the offset of the first token in each block, so
+	 * decoding starts at most a block's worth of columns before rx. */
+	const uint8_t *p = &ribbon_data[pgm_read_word(
+	        &ribbon_index[rx >> RIBBON_BLOCK_SHIFT])];
+	uint8_t skip = rx & ((1 << RIBBON_BLOCK_SHIFT) - 1);
+	uint8_t h, count, i;
+	uint8_t col[RIBBON_BYTES];
+
+	while (n) {
+		h = pgm_read_byte(p++);
+		for (i = 0; i < RIBBON_BYTES; i++)
+			col[i] = (h & (0x08 >> i)) ? pgm_read_byte(p++) : 0;
+
+		count = (h >> 4) + 1;
+		if (skip >= count) {
+			skip -= count;
+			continue;
+		}
+		count -= skip;
+		skip = 0;
+		if (count > n)
+			count = n;
+		n -= count;
+
+		while (count--) {
+			for (i = 0; i < RIBBON_BYTES; i++)
+				dst[RIBBON_TOP + i] = col[i];
+			dst += DISPLAY_BYTES;
+		}
+	}
+}
+
+/* The selected logo, decoded, for rendering it by itself without decoding
+ * the rest of the visible ribbon.  Holds the columns from logo_cache_edge0 up
+ * to the logo's edge1, laid out like the video buffer so they can be copied
+ * straight in. */
+static uint8_t logo_cache[RIBBON_LOGO_MAX * DISPLAY_BYTES];
+static int16_t logo_cache_edge0 = -1;
+
 static void
 blit_ribbon(uint8_t *buf, uint16_t edge0, uint16_t edge1, uint8_t blank)
 {
 	/* Render the ribbon.  If blank evaluates to true, only render the part
-	 * of the ribbon between edge0 and edge1. */
-	int16_t px, rx;
-	uint8_t *dst, *src;
-
-	/* One column at a time. */
-	for (px = 0; px < 140; px++) {
-		/* rx is the column for ribbon_pixel to render.  Wrap the
-		 * column if <0 or >ribbon_width */
-		rx = pos - 70 + px;
-		if (rx < 0)
-			rx += ribbon_width;
+	 * of the ribbon between edge0 and edge1.
+	 *
+	 * Rather than working out what to do for each of the columns, the
+	 * visible part of the ribbon is split into at most five spans of
+	 * consecutive ribbon columns - at the point where the ribbon wraps, and
+	 * at edge0 and edge1 - and each span is rendered with a straight copy,
+	 * inverted copy or fill. */
+	uint16_t rx, rx0, limit, n;
+	display_column_t px;
+	uint8_t *dst;
+
+	if (input < 0) {
+		/* Nothing is selected, so there is no logo to highlight. */
+		edge0 = 0;
+		edge1 = 0;
+	}
+
+	/* rx0 is the ribbon column to render in the first column of the
+	 * display. */
+	if (pos < DISPLAY_WIDTH / 2)
+		rx0 = pos + ribbon_width - DISPLAY_WIDTH / 2;
+	else
+		rx0 = pos - DISPLAY_WIDTH / 2;
+
+	if (!blank) {
+		/* Decode all of the visible ribbon straight into the video
+		 * buffer, and then fix up the spans below in place. */
+		for (px = 0, rx = rx0; px < DISPLAY_WIDTH; px += n, rx = 0) {
+			n = ribbon_width - rx;
+			if (n > DISPLAY_WIDTH - px)
+				n = DISPLAY_WIDTH - px;
+			ribbon_decode(&buf[px * DISPLAY_BYTES], rx, n);
+		}
+	}
+	else if ((edge0 < edge1) && (logo_cache_edge0 != (int16_t)edge0)) {
+		/* Only the selected logo is visible, so work from the cache. */
+		ribbon_decode(logo_cache, edge0, edge1 - edge0);
+		logo_cache_edge0 = edge0;
+	}
+
+	for (px = 0, rx = rx0; px < DISPLAY_WIDTH; px += n) {
+		/* This span runs until the next edge or the end of the
+		 * ribbon, whichever comes first. */
+		if (rx < edge0)
+			limit = edge0;
+		else if (rx < edge1)
+			limit = edge1;
 		else
-			rx %= ribbon_width;
-		dst = &buf[px * 4];
-		src = &ribbon_pixel[rx * 4];
-		if ((input >= 0) && (rx >= edge0) && (rx < edge1)) {
+			limit = ribbon_width;
+		n = limit - rx;
+		if (n > DISPLAY_WIDTH - px)
+			n = DISPLAY_WIDTH - px;
+
+		dst = &buf[px * DISPLAY_BYTES];
+		if ((rx >= edge0) && (rx < edge1)) {
 			/* Render selected logo between edge0 and edge1.  This
-			 * is drawn with light pixels on a dark background.
-			 * The 0x80 and 0x01 masks below round off the corners
-			 * of the black background. */
-			if (!blank && (rx == edge0))
-				*dst++ = 0x80 | *src++;
-			else if (!blank && (rx == (edge1 - 1)))
-				*dst++ = 0x80 | *src++;
-			else
-				*dst++ = *src++;
-			*dst++ = *src++;
-			*dst++ = *src++;
-			if (!blank && (rx == edge0))
-				*dst++ = 0x01 | *src++;
-			else if (!blank && (rx == (edge1 - 1)))
-				*dst++ = 0x01 | *src++;
-			else
-				*dst++ = *src++;
+			 * is drawn with light pixels on a dark background, as
+			 * decoded. */
+			if (blank)
+				memcpy(dst, &logo_cache[(rx - edge0)
+				                        * DISPLAY_BYTES],
+				       n * DISPLAY_BYTES);
+		}
+		else if (blank) {
+			/* If blank is enabled, don't render outside of edge0
+			 * and edge1. */
+			memset(dst, 0, n * DISPLAY_BYTES);
 		}
 		else {
-			if (blank
-			    && ((rx < edge0) || (rx >= edge1))) {
-				/* If blank is enabled, don't render outside of
-				 * edge0 and edge1. */
-				*dst++ = 0;
-				*dst++ = 0;
-				*dst++ = 0;
-				*dst++ = 0;
-			}
-			else {
-				/* Render the area outside of edge0 and edge1
-				 * inverted - dark pixels on a light
-				 * background. */
-				*dst++ = ~(*src++);
-				*dst++ = ~(*src++);
-				*dst++ = ~(*src++);
-				*dst++ = ~(*src++);
+			/* Render the area outside of edge0 and edge1 inverted
+			 * - dark pixels on a light background. */
+			uint16_t i = n * DISPLAY_BYTES;
+			while (i--) {
+				*dst = ~*dst;
+				dst++;
 			}
 		}
+
+		rx += n;
+		if (rx >= ribbon_width)
+			rx = 0;
 	}
 
+	if (!blank && (edge0 < edge1)) {
+		/* The 0x80 and 0x01 masks round off the corners of the black
+		 * background of the selected logo, in its first and last
+		 * columns if they're on screen. */
+		n = (edge0 >= rx0) ? (edge0 - rx0) : (edge0 + ribbon_width - rx0);
+		if (n < DISPLAY_WIDTH) {
+			buf[n * DISPLAY_BYTES] |= 0x80;
+			buf[n * DISPLAY_BYTES + DISPLAY_BYTES - 1] |= 0x01;
+		}
+		n = (edge1 - 1 >= rx0) ? (edge1 - 1 - rx0)
+		                       : (edge1 - 1 + ribbon_width - rx0);
+		if (n < DISPLAY_WIDTH) {
+			buf[n * DISPLAY_BYTES] |= 0x80;
+			buf[n * DISPLAY_BYTES + DISPLAY_BYTES - 1] |= 0x01;
+		}
+	}
+}
 
+static void
+blit_uptime(uint8_t *dst, const uint8_t (*ut)[UPTIME_STRIDE], uint16_t row)
+{
+	/* Blit a RIBBON_HEIGHT-row window of the uptime buffer, starting at
+	 * row, into UPTIME_COLUMNS columns of the video buffer, starting with
+	 * the column at dst.  Each column of the window fills the bytes of the
+	 * column from RIBBON_TOP, so it sits over the ribbon.
+	 *
+	 * Each byte of a column of the window is shifted up into place with
+	 * the top of the byte below it shifting in.  RIBBON_BYTES is a
+	 * constant, so this is unrolled into straight-line code for each
+	 * column.  The seam in the ring means this never has to wrap. */
+	uint8_t slot = (row >> 3) & (UPTIME_RING - 1);
+	uint8_t shift = row & 7;
+	uint8_t px, i;
+	const uint8_t *src;
+
+	dst += RIBBON_TOP;
+	for (px = 0; px < UPTIME_COLUMNS; px++) {
+		src = &ut[px][slot];
+		for (i = 0; i < RIBBON_BYTES; i++)
+			dst[i] = (src[i] << shift)
+			         | (src[i + 1] >> (8 - shift));
+		/* Clear the first and last row of pixels of the window to form
+		 * top and bottom margins. */
+		dst[0] &= 0x7f;
+		dst[RIBBON_BYTES - 1] &= 0xfe;
+		dst += DISPLAY_BYTES;
+	}
 }
 
+/* The first row of the uptime buffer in the Info window. */
+static uint16_t uptime_row = 0;
+
 static void
-blit_uptime(uint8_t *buf, const uint8_t *utbuf,
-            uint16_t edge0, uint16_t edge1,
-	    uint8_t tline, uint8_t trow)
+uptime_scroll(uint16_t now)
 {
-	/* Blit 4 lines of text worth of pixels from the uptime buffer into a
-	 * window in the main buffer.  tline is the line of text to draw first.
-	 * trow is the row within that line to draw first.*/
+	/* The scroll deadline is due.  Scroll a row for each SCROLL_DELAY
+	 * that has passed and set the deadline for the next, keeping in phase
+	 * with the first. */
+	uint16_t at = deadline_ticks;
+	uint8_t n = 0;
+
+	do {
+		at += SCROLL_DELAY;
+		if (++uptime_row >= UPTIME_ROWS)
+			uptime_row = 0;
+	} while (((int16_t)(now - at) >= 0) && (++n < SCROLL_MAX_ROWS));
+	if (n >= SCROLL_MAX_ROWS)
+		at = now + SCROLL_DELAY;
+	deadline_set(at);
+}
 
-	/* This is a bit of a mess and should probably just be rewritten if it
-	 * ever needs to be changed. */
+/* An unused multiplexer address, which banks are left on while they aren't
+ * selected. */
+#define UNUSED_INPUT 0x17
+
+static void
+mux_write(uint8_t bank, uint8_t address)
+{
+	/* Route address on bank through to the outputs, or nothing if bank is
+	 * MUX_NONE.  Every bank is disabled while the addresses change, and
+	 * the others are left disabled, and on UNUSED_INPUT for any bank
+	 * that can't be disabled. */
+	uint8_t b;
+
+	hal_mux_enable(0);
+	for (b = 0; b < MUX_BANKS; b++)
+		hal_mux_write(b, (b == bank) ? address : UNUSED_INPUT);
+	if (bank != MUX_NONE)
+		hal_mux_enable(1 << bank);
+}
+
+
+/* Input switching.  Changing the multiplexers in the middle of a field tears
+ * the picture and makes downstream scalers lose sync, so switches are made
+ * in the vertical blanking interval.  A sync separator on the multiplexers'
+ * video output drives the timer 1 input capture, and a switch waits for the
+ * next vertical sync it captures, or for VSYNC_TIMEOUT ticks if there's no
+ * video.  With AUDIO_MUTE, the audio is muted from when the switch is asked
+ * for until AUDIO_MUTE_HOLD ticks after it's made.  Timer 1 compare C times
+ * both. */
+#define VSYNC_TIMEOUT 781 /* 25 ms, longer than a 50 Hz field. */
+#define AUDIO_MUTE_HOLD 625 /* 20 ms */
+#ifndef AUDIO_MUTE
+#define AUDIO_MUTE 1
+#endif
+
+volatile static enum {
+	SWITCH_IDLE,
+	SWITCH_PENDING,
+	/* Waiting for vertical sync or the timeout. */
+	SWITCH_MUTED
+	/* Switched, waiting to unmute. */
+} switch_state = SWITCH_IDLE;
+static uint8_t switch_bank;
+static uint8_t switch_address;
+
+static void
+switch_now(void)
+{
+	/* Make the pending switch.  Called from the interrupts. */
+	hal_vsync_disarm();
+	mux_write(switch_bank, switch_address);
+	if (AUDIO_MUTE) {
+		switch_state = SWITCH_MUTED;
+		hal_switch_arm(hal_ticks() + AUDIO_MUTE_HOLD);
+	}
+	else {
+		switch_state = SWITCH_IDLE;
+		hal_switch_disarm();
+	}
+}
+
+ISR(TIMER1_CAPT_vect)
+{
+	if (switch_state == SWITCH_PENDING)
+		switch_now();
+}
+
+ISR(TIMER1_COMPC_vect)
+{
+	if (switch_state == SWITCH_PENDING) {
+		/* No vertical sync in time. */
+		switch_now();
+	}
+	else {
+		hal_switch_disarm();
+		hal_audio_mute(0);
+		switch_state = SWITCH_IDLE;
+	}
+}
+
+static void
+mux_select(uint8_t bank, uint8_t address)
+{
+	/* Switch to address on bank in the next vertical blanking interval,
+	 * and remember it for the next reset.  Replaces any switch still
+	 * pending. */
+	cli();
+	switch_bank = bank;
+	switch_address = address;
+	switch_state = SWITCH_PENDING;
+	if (AUDIO_MUTE)
+		hal_audio_mute(1);
+	hal_vsync_arm();
+	hal_switch_arm(hal_ticks() + VSYNC_TIMEOUT);
+	sei();
+	eeprom_write_mux(bank, address);
+}
+
+BOOT()
+{
+	/* Put the multiplexers back on the last input straight after reset,
+	 * before the variables are even set up, so that after a power blip
+	 * the source only drops out for as long as the supply did.  All the
+	 * rest of starting up, the VFD included, comes after. */
+	uint8_t bank, address;
+
+	hal_mux_init((1 << MUX_BANKS) - 1);
+	if (eeprom_read_mux(&bank, &address))
+		mux_write(bank, address);
+	else
+		mux_write(MUX_NONE, UNUSED_INPUT);
+}
+
+static int8_t
+nearest_input(int16_t pos)
+{
+	/* Look up the input under column pos of the ribbon.  input_blocks
+	 * gives the input at the start of pos's block, and no input is
+	 * narrower than a block, so it's either that one or the next. */
+	uint8_t i = pgm_read_byte(&input_blocks[pos >> INPUT_BLOCK_SHIFT]);
+
+	if (pos >= pgm_read_word(&input_edges[i + 1]))
+		i++;
+	return i;
+}
 
-	uint8_t r;
-	int16_t px, rx;
-	uint8_t *dst;
-	const uint8_t *src;
 
-	/* r is the line of text offset to render. */
-	for (r = 0; r < 4; r++) {
-		/* px is the column offset in both buf and utbuf. */
-		for (px = 0; px < 40; px++) {
-			/* rx is the first column of buf to blit into. */
-			rx = edge0 - pos + 70 + 2;
-			dst = &buf[(rx + px) * 4 + r];
-			/* The + 2 is for the two lines of padding in the
-			 * uptime buffer. */
-			src = &utbuf[((tline + r) %
-			             (2 * (NUM_INPUTS) + 2)) * 40 + px];
-
-			if (trow == 0) {
-				/* If we started with the 0th column we can do
-				 * a straight copy. */
-				*dst = *src;
+/* HDMI-CEC.  Another device on the TV's CEC bus becoming the active source,
+ * or the TV routing to one, switches to the input with that physical address
+ * (see stitch.py), and the ribbon springs around to it as if the knob had
+ * been turned there.  Switching with the knob is announced with a <Routing
+ * Change>.  The switch doesn't claim a logical address, so it's unregistered
+ * (15), only ever broadcasts, and never has to acknowledge anything.
+ *
+ * Bits are timed by timer 3 interrupts rather than by waiting on the line, so
+ * CEC carries on alongside rendering.  Receiving, the input capture
+ * timestamps each edge, and a bit's value is told from how long the line was
+ * held low.  Sending, compare B drives the line, and looks at it again where
+ * followers read a 1 bit.  Held low there means another initiator has won
+ * arbitration with a 0, and the rest of its frame is received instead, or in
+ * the acknowledge bit, that a follower has rejected the broadcast.  Compare B
+ * also gives up on a frame that stops arriving, and waits out the signal free
+ * time before sending.  Ticks are 32 us.
+ *
+ * Build with DEFS=-DCEC=0 to leave the line alone. */
+#ifndef CEC
+#define CEC 1
+#endif
+/* Sending. */
+#define CEC_START_LOW        116 /* 3.7 ms */
+#define CEC_START_PERIOD     141 /* 4.5 ms */
+#define CEC_ONE_LOW          19  /* 0.6 ms */
+#define CEC_ZERO_LOW         47  /* 1.5 ms */
+#define CEC_SAMPLE           33  /* 1.05 ms, where followers read a bit. */
+#define CEC_PERIOD           75  /* 2.4 ms */
+/* Receiving. */
+#define CEC_START_LOW_MIN    109 /* 3.5 ms */
+#define CEC_START_LOW_MAX    122 /* 3.9 ms */
+#define CEC_START_PERIOD_MAX 147 /* 4.7 ms */
+#define CEC_ONE_LOW_MIN      12  /* 0.4 ms */
+#define CEC_ZERO_LOW_MAX     53  /* 1.7 ms */
+#define CEC_PERIOD_MAX       86  /* 2.75 ms */
+/* Signal free time before sending, 7 bit periods for a new frame and 3 to
+ * try one again. */
+#define CEC_FREE_NEW   (7 * CEC_PERIOD)
+#define CEC_FREE_RETRY (3 * CEC_PERIOD)
+#define CEC_ATTEMPTS 3
+#define CEC_MAX_BLOCKS 16
+
+/* From unregistered to broadcast. */
+#define CEC_HEADER 0xff
+#define CEC_ROUTING_CHANGE  0x80
+#define CEC_ACTIVE_SOURCE   0x82
+#define CEC_SET_STREAM_PATH 0x86
+
+struct cec_frame {
+	uint8_t len;
+	uint8_t data[CEC_MAX_BLOCKS];
+};
+
+volatile static enum {
+	CEC_IDLE,
+	/* Waiting for a start bit, and for the line to be free to send. */
+	CEC_RX,
+	/* Receiving a frame. */
+	CEC_TX
+	/* Sending one. */
+} cec_state = CEC_IDLE;
+/* The frame on the line, sent or received, and the bit of its next block
+ * being timed: 0-7 are data, 8 is end of message, 9 is acknowledge, and -1
+ * is the start bit. */
+static struct cec_frame cec_line;
+static int8_t cec_bit;
+static uint8_t cec_eom;
+/* When the bit started, and whether the line is low in it. */
+static uint16_t cec_fall;
+static uint8_t cec_low = 0;
+/* When compare B is next due, sending. */
+static uint16_t cec_at;
+static enum {
+	CEC_TX_FALL,
+	CEC_TX_RISE,
+	CEC_TX_SAMPLE
+} cec_tx_step;
+/* Whether the line has been free for long enough to send right away. */
+static uint8_t cec_free = 0;
+/* The last frame received, for the main loop. */
+static struct cec_frame cec_rx;
+volatile static uint8_t cec_rx_ready = 0;
+/* The frame to send, and how many more times to try it. */
+static struct cec_frame cec_tx;
+volatile static uint8_t cec_tx_attempts = 0;
+
+static void
+cec_arm(uint16_t at)
+{
+	/* Interrupt at tick at, or straight away if it has gone by. */
+	if ((int16_t)(hal_cec_ticks() - at) >= 0)
+		at = hal_cec_ticks() + 1;
+	hal_cec_arm(at);
+}
+
+static void
+cec_idle(uint16_t end, uint16_t free)
+{
+	/* The line went quiet at end.  Wait for the next start bit, and for
+	 * free ticks more before sending anything. */
+	cec_state = CEC_IDLE;
+	cec_low = 0;
+	cec_free = 0;
+	hal_cec_capture(0);
+	cec_arm(end + free);
+}
+
+static uint8_t
+cec_bit_done(uint8_t one)
+{
+	/* Store a bit sent or received, and move on to the next.  Returns
+	 * non-zero if it ended the frame.  Blocks past CEC_MAX_BLOCKS are
+	 * timed but not kept. */
+	uint8_t block = cec_line.len;
+
+	if (cec_bit < 8) {
+		if (block < CEC_MAX_BLOCKS)
+			cec_line.data[block] = (cec_line.data[block] << 1) | one;
+	}
+	else if (cec_bit == 8) {
+		cec_eom = one;
+	}
+	else {
+		if (block < CEC_MAX_BLOCKS)
+			cec_line.len++;
+		cec_bit = 0;
+		return cec_eom;
+	}
+	cec_bit++;
+	return 0;
+}
+
+static uint8_t
+cec_tx_bit(void)
+{
+	/* The bit being sent.  Acknowledges go out as 1, for followers to
+	 * pull down. */
+	uint8_t block = cec_line.len;
+
+	if (cec_bit < 8)
+		return (cec_tx.data[block] >> (7 - cec_bit)) & 1;
+	if (cec_bit == 8)
+		return block == cec_tx.len - 1;
+	return 1;
+}
+
+static void
+cec_tx_arm(uint16_t at)
+{
+	cec_at = at;
+	hal_cec_arm(at);
+}
+
+static void
+cec_tx_next(void)
+{
+	/* Take the frame being sent a step further. */
+	switch (cec_tx_step) {
+	case CEC_TX_FALL:
+		cec_fall = cec_at;
+		hal_cec_drive(1);
+		cec_tx_step = CEC_TX_RISE;
+		if (cec_bit < 0)
+			cec_tx_arm(cec_fall + CEC_START_LOW);
+		else
+			cec_tx_arm(cec_fall + (cec_tx_bit() ? CEC_ONE_LOW
+			                                    : CEC_ZERO_LOW));
+		break;
+	case CEC_TX_RISE:
+		hal_cec_drive(0);
+		cec_tx_step = CEC_TX_FALL;
+		if (cec_bit < 0) {
+			cec_bit = 0;
+			cec_tx_arm(cec_fall + CEC_START_PERIOD);
+		}
+		else if (!cec_tx_bit()) {
+			cec_bit_done(0);
+			cec_tx_arm(cec_fall + CEC_PERIOD);
+		}
+		else {
+			cec_tx_step = CEC_TX_SAMPLE;
+			cec_tx_arm(cec_fall + CEC_SAMPLE);
+		}
+		break;
+	case CEC_TX_SAMPLE:
+		if (hal_cec_line()) {
+			cec_tx_step = CEC_TX_FALL;
+			if (cec_bit_done(1)) {
+				/* Sent. */
+				cec_tx_attempts = 0;
+				cec_idle(cec_fall + CEC_PERIOD, CEC_FREE_NEW);
 			}
 			else {
-				/* Otherwise we need to shift the pixels up and
-				 * merge them with part of the next line. */
-				if (r < 4) {
-					if ((tline + r) == (2 * NUM_INPUTS) + 2 - 1) {
-						/* The last line in the uptime
-						 * buffer needs to be shifted
-						 * and combined with the first
-						 * line in the uptime buffer in
-						 * order to wrap properly. */
-						*dst = (utbuf[px] >> (8 - trow)) | (*src << trow);
-					}
-					else {
-						/* Other lines just need to be
-						 * shifted and merged with the
-						 * first part of the next line.
-						 * */
-						*dst = (*(src+40) >> (8 - trow)) | (*src << trow);
-					}
-				}
-				else {
-					/* And the final line is just the first
-					 * part of the next line. */
-					*dst = *src << trow;
-				}
+				cec_tx_arm(cec_fall + CEC_PERIOD);
 			}
-			/* Finally, clear the first and last row of pixels of
-			 * the window to form top and bottom margins. */
-			if (r == 0) {
-				*dst &= 0x7f;
-			}
-			else if (r == 3) {
-				*dst &= 0xfe;
+		}
+		else if (cec_bit == 9) {
+			/* Rejected by a follower.  Try again, or give up. */
+			cec_tx_attempts--;
+			cec_idle(cec_fall + CEC_PERIOD,
+			         cec_tx_attempts ? CEC_FREE_RETRY : CEC_FREE_NEW);
+		}
+		else {
+			/* Lost arbitration.  Receive the winner's 0 and the
+			 * rest of its frame, and try again after it. */
+			cec_state = CEC_RX;
+			cec_low = 1;
+			hal_cec_capture(1);
+			hal_cec_arm(cec_fall + CEC_ZERO_LOW_MAX + 1);
+		}
+		break;
+	}
+}
+
+ISR(TIMER3_CAPT_vect)
+{
+	uint16_t at = hal_cec_captured();
+	uint16_t low = at - cec_fall;
+	uint8_t start = (cec_bit < 0);
+
+	if (!cec_low) {
+		/* The line has fallen, for a start bit if nothing was being
+		 * received, or else the next bit. */
+		if (cec_state == CEC_IDLE) {
+			cec_state = CEC_RX;
+			cec_free = 0;
+			cec_bit = -1;
+			cec_line.len = 0;
+			start = 1;
+		}
+		cec_fall = at;
+		cec_low = 1;
+		hal_cec_capture(1);
+		cec_arm(at + (start ? CEC_START_LOW_MAX : CEC_ZERO_LOW_MAX) + 1);
+		return;
+	}
+
+	/* The line has risen. */
+	cec_low = 0;
+	if (start) {
+		if (low < CEC_START_LOW_MIN) {
+			cec_idle(at, CEC_FREE_NEW);
+			return;
+		}
+		cec_bit = 0;
+	}
+	else {
+		if (low < CEC_ONE_LOW_MIN) {
+			cec_idle(at, CEC_FREE_NEW);
+			return;
+		}
+		if (cec_bit_done(low <= CEC_SAMPLE)) {
+			if (!cec_rx_ready) {
+				cec_rx = cec_line;
+				cec_rx_ready = 1;
 			}
+			cec_idle(cec_fall + CEC_PERIOD, CEC_FREE_NEW);
+			return;
 		}
 	}
+	hal_cec_capture(0);
+	cec_arm(cec_fall + (start ? CEC_START_PERIOD_MAX : CEC_PERIOD_MAX) + 1);
+}
 
+ISR(TIMER3_COMPB_vect)
+{
+	switch (cec_state) {
+	case CEC_IDLE:
+		if (!cec_tx_attempts) {
+			/* Nothing to send yet, but the next frame can go
+			 * straight out. */
+			hal_cec_disarm();
+			cec_free = 1;
+		}
+		else if (!hal_cec_line()) {
+			/* Somebody else started first, and the capture will
+			 * pick them up. */
+			hal_cec_disarm();
+		}
+		else {
+			cec_state = CEC_TX;
+			hal_cec_capture_off();
+			cec_bit = -1;
+			cec_line.len = 0;
+			cec_at = hal_cec_ticks();
+			cec_tx_step = CEC_TX_FALL;
+			cec_tx_next();
+		}
+		break;
+	case CEC_RX:
+		/* The line stopped changing mid-frame, or was held low for
+		 * too long.  Drop what was received. */
+		cec_idle(hal_cec_ticks(), CEC_FREE_NEW);
+		break;
+	case CEC_TX:
+		cec_tx_next();
+		break;
+	}
 }
 
-/* An unused multiplexer address. */
-#define UNUSED_INPUT 0x17
+static void
+cec_init(void)
+{
+	hal_cec_init();
+	cli();
+	cec_idle(hal_cec_ticks(), CEC_FREE_NEW);
+	sei();
+}
+
+static void
+cec_send(const uint8_t *data, uint8_t len)
+{
+	/* Broadcast a frame once the line is free, in place of any still
+	 * waiting to go.  Waits for one already going out to finish. */
+	cli();
+	while (cec_state == CEC_TX) {
+		sei();
+		hal_idle();
+		cli();
+	}
+	memcpy(cec_tx.data, data, len);
+	cec_tx.len = len;
+	cec_tx_attempts = CEC_ATTEMPTS;
+	if ((cec_state == CEC_IDLE) && cec_free)
+		cec_arm(hal_cec_ticks() + 1);
+	sei();
+}
+
+static void
+cec_routing_change(int8_t from, int8_t to)
+{
+	/* Announce a switch with the knob from input from, or -1 for none, to
+	 * input to.  Inputs without a physical address are routed from the
+	 * switch's own. */
+	uint16_t old_address = CEC_NONE;
+	uint16_t new_address = pgm_read_word(&inputs[to].cec);
+	uint8_t frame[6];
+
+	if (!CEC || (new_address == CEC_NONE))
+		return;
+	if (from >= 0)
+		old_address = pgm_read_word(&inputs[from].cec);
+	if (old_address == CEC_NONE)
+		old_address = CEC_ADDRESS;
+	frame[0] = CEC_HEADER;
+	frame[1] = CEC_ROUTING_CHANGE;
+	frame[2] = old_address >> 8;
+	frame[3] = old_address;
+	frame[4] = new_address >> 8;
+	frame[5] = new_address;
+	cec_send(frame, sizeof(frame));
+}
 
 static int8_t
-nearest_input(int16_t pos)
+cec_poll(void)
 {
+	/* Take the last frame received, and return the input it asks to be
+	 * switched to, or -1. */
+	struct cec_frame f;
+	uint16_t address, cec, mask;
 	uint8_t i;
-	pos = pos % ribbon_width;
-	for (i = 0; i < 12; i++) {
-		if (inputs[i].address) {
-			if ((pos >= (inputs[i].begin))
-			    && (pos <= (inputs[i].end))) {
-				return i;
-			}
-		}
+
+	cli();
+	f = cec_rx;
+	cec_rx_ready = 0;
+	sei();
+
+	if (f.len < 4)
+		return -1;
+	switch (f.data[1]) {
+	case CEC_ACTIVE_SOURCE:
+	case CEC_SET_STREAM_PATH:
+		address = (f.data[2] << 8) | f.data[3];
+		break;
+	case CEC_ROUTING_CHANGE:
+		if (f.len < 6)
+			return -1;
+		address = (f.data[4] << 8) | f.data[5];
+		break;
+	default:
+		return -1;
+	}
+
+	/* Devices further down from an input have addresses that start with
+	 * its, so only its nibbles down to the last non-zero one count. */
+	for (i = 0; i < NUM_INPUTS; i++) {
+		cec = pgm_read_word(&inputs[i].cec);
+		if (cec == CEC_NONE)
+			continue;
+		mask = 0xffff;
+		while ((mask & 0x0fff) && !(cec & mask & ~(mask << 4)))
+			mask <<= 4;
+		if ((address & mask) == cec)
+			return i;
 	}
 	return -1;
 }
@@ -616,156 +2454,214 @@ main(void)
 {
 	uint16_t my_ticks;
 	uint8_t blank;
-	/* Main video buffer.  Both this and the uptime buffer are in the same
-	 * format used by the VFD interface - column-major order, each byte is
-	 * 8 consecutive vertical pixels. */
-	uint8_t buf[140 * 4] = { 0 };
+	/* Set when the display needs redrawing, and what it last showed. */
+	uint8_t display_invalid = 1;
+	int16_t frame_pos = -1;
+	int16_t shift;
+	uint8_t frame_state = 0xff;
+	/* When the last frame was drawn, and whether the frame timer is
+	 * running. */
+	uint16_t frame_ticks = 0;
+	uint8_t frame_armed = 0;
+	/* Uptimes to redraw. */
+	uint8_t changed[UPTIME_MASK_BYTES];
+	uint8_t redrawn;
+	uint8_t i;
+	/* When the frame being rendered was started, and the time spent in
+	 * blits so far. */
+	uint32_t render_start, blit_ticks;
+	/* The input routed through the multiplexers, and one asked for over
+	 * HDMI-CEC. */
+	int8_t mux_input = -1;
+	int8_t cec_input;
+	/* The multiplexer bank and address restored at reset. */
+	uint8_t bank, address;
+	/* Main video buffers.  Both these and the uptime buffer are in the
+	 * same format used by the VFD interface - column-major order, each
+	 * byte is 8 consecutive vertical pixels.  One frame is rendered into
+	 * buf while the other, shown, is still being sent to the VFD. */
+	uint8_t frames[2][DISPLAY_WIDTH * DISPLAY_BYTES] = { { 0 } };
+	uint8_t *buf = frames[0];
+	uint8_t *shown = NULL;
 	/* Uptime buffer, blitted into the video buffer with vertical scrolling
-	 * when Info input is selected.  The buffer is 40 pixels wide, and each
-	 * line of text takes 40 bytes.  The buffer starts with two empty lines
-	 * for spacing, followed by two lines for each input. */
-	uint8_t utbuf[80 + 2 * 40 * (NUM_INPUTS)] = { 0 };
+	 * when Info input is selected. */
+	uint8_t utbuf[UPTIME_COLUMNS][UPTIME_STRIDE];
 
 	/* edge0 and edge1 are the left and right column boundaries of the
 	 * current logo in the ribbon. */
-	int16_t edge0 = inputs[0].begin, edge1 = inputs[0].end;
+	int16_t edge0 = 0, edge1 = 0;
+	/* The first column of the uptime window on the display. */
+	display_column_t window;
 
 
-	/* Set multiplexer address pins to outputs. */
-	DDRA = 0x1f;
-	/* Select an unsed input. */
-	PORTA = UNUSED_INPUT;
+	/* The multiplexers are already back on the last input, see BOOT().
+	 * Everything else runs at full speed. */
+	hal_clock_init();
+	hal_audio_init();
 
 	vfd_init();
-	vfd_brightness(0x08);
 
 	encoder_init();
 
+	/* The VFD is written from interrupts from here on. */
 	sei();
 
+	vfd_brightness(0x08);
+
 	/* Load previous state */
-	pos = eeprom_read_word(EEPROM_POS_ADDRESS);
+	pos = hal_eeprom_read_word(EEPROM_POS_ADDRESS);
 	if ((pos < 0) || (pos >= ribbon_width)) {
 		pos = 0;
 	}
-	eeprom_read_uptime((uint32_t *)uptimes);
+	/* If the input that was restored at reset is still configured,
+	 * start with it centered, rather than switching to it all over
+	 * again. */
+	if (eeprom_read_mux(&bank, &address)) {
+		for (i = 0; i < NUM_INPUTS; i++) {
+			if ((pgm_read_byte(&inputs[i].bank) == bank)
+			    && (pgm_read_byte(&inputs[i].address) == address)) {
+				mux_input = i;
+				pos = pgm_read_word(&input_centers[i]);
+				state = S_CENTERED;
+				break;
+			}
+		}
+	}
+	motion_set(pos);
+	journal_load(uptimes);
+	power_init();
 
-	/* Set up general purpose counter for timing pos, velocity updates and
+	/* Set up general purpose counter for timing motion updates and
 	 * state transition delays. */
-	TCCR1A = 0;
-	TCCR1B = _BV(CS12); /* CLK / 256*/
-	TCNT1 = 0;
+	hal_ticks_init();
+	hal_vsync_init();
 
 	init_uptime_counter();
+	if (CEC)
+		cec_init();
+	if (DIAGNOSTICS)
+		hal_prof_init();
 
-	/* Enable writes to clock prescalar. */
-	CLKPR = _BV(CLKPCE);
-	/* Set clock prescalar division factor to 1. */
-	CLKPR = 0;
+	/* Nothing has been drawn yet, and unless an input was restored, the
+	 * first state delay runs from boot. */
+	if (state != S_CENTERED)
+		deadline_set(STATE_DELAY);
+	frame_due = 1;
 
 	while (1) {
-		/* The main loop starts with an empty video buffer. */
-		memset(buf, 0, 140 * 4);
-
-		/* If any of the uptimes have changed, redraw the whole
-		 * vertical uptime buffer. */
+		/* Redraw the lines of the uptime buffer for any uptimes
+		 * that have changed. */
 		if (uptimes_dirty) {
+			cli();
+			for (i = 0; i < UPTIME_MASK_BYTES; i++) {
+				changed[i] = uptimes_changed[i];
+				uptimes_changed[i] = 0;
+			}
 			uptimes_dirty = 0;
-			render_uptime(utbuf, (uint32_t *)uptimes);
-			eeprom_write_uptime((uint32_t *)uptimes);
+			sei();
+			redrawn = render_uptime(utbuf, uptimes, changed);
+			if (redrawn && (state == S_INFOSCROLL))
+				display_invalid = 1;
 		}
-
-		my_ticks = TCNT1;
-
-		if (state == S_MENU) {
+		/* Save them if the power is going away, or otherwise when
+		 * the safety save is due. */
+		if (power_failing)
+			power_fail();
+		journal_service(uptimes, 0);
+
+		my_ticks = hal_ticks();
+
+		/* Knob movement goes back to the menu. */
+		encoder_poll();
+
+		/* A switch asked for over HDMI-CEC is made right away, and
+		 * the ribbon springs around to the input. */
+		cec_input = (CEC && cec_rx_ready) ? cec_poll() : -1;
+		if ((cec_input >= 0) && (cec_input != mux_input)) {
+			mux_input = cec_input;
+			mux_select(pgm_read_byte(&inputs[mux_input].bank),
+			           pgm_read_byte(&inputs[mux_input].address));
+			deadline_cancel();
+			state = S_SELECTED;
+			motion_target = pgm_read_word(&input_centers[mux_input]);
 			vfd_brightness(0x08);
-			/* Apply velocity to position and decay to velocity. */
-			if ((my_ticks - pos_ticks) >= POS_INTERVAL) {
-				pos += velocity;
-				if (pos < 0)
-					pos += ribbon_width;
-				else
-					pos %= ribbon_width;
-				pos_ticks = my_ticks;
-			}
-			if ((my_ticks - velocity_ticks) >= VELOCITY_INTERVAL) {
-				if (velocity < 0)
-					velocity++;
-				else if (velocity > 0)
-					velocity--;
-				velocity_ticks = my_ticks;
-			}
 		}
 
+		if (state == S_MENU)
+			vfd_brightness(0x08);
+		/* Bring the ribbon's motion up to date. */
+		motion_update(my_ticks);
+
 		/* Find the nearest input to the current position on the
 		 * ribbon.  This is used in a few states below, and edge0 and
 		 * edge1 are important for rendering the UI. */
 		input = nearest_input(pos);
-		if (input >= 0) {
-			edge0 = inputs[input].begin;
-			edge1 = inputs[input].end;
+		edge0 = pgm_read_word(&input_edges[input]);
+		edge1 = pgm_read_word(&input_edges[input + 1]);
+
+		if (FAST_SWITCH && (state == S_MENU) && deadline_due) {
+			/* The knob has been still for a moment.  Switch to
+			 * the input the ribbon is coasting to right away, and
+			 * spring it to the center. */
+			deadline_due = 0;
+			input = nearest_input(motion_rest());
+			if (input != mux_input) {
+				cec_routing_change(mux_input, input);
+				mux_input = input;
+				mux_select(pgm_read_byte(&inputs[input].bank),
+				           pgm_read_byte(&inputs[input].address));
+			}
+			state = S_SELECTED;
+			motion_target = pgm_read_word(&input_centers[input]);
 		}
-
-		if ((velocity == 0) && (state == S_MENU)) {
+		else if ((motion_v == 0) && (state == S_MENU)) {
 			/* Due to lack of rotary encoder movement, velocity has
 			 * decayed to 0. */
 			state = S_STOPPED;
-			last_ticks = my_ticks;
+			deadline_set(my_ticks + STATE_DELAY);
 		}
-		else if ((state == S_STOPPED) &&
-		    ((my_ticks - last_ticks) >= STATE_DELAY)) {
+		else if ((state == S_STOPPED) && deadline_due) {
 			/* After a delay there is still no movement, so we have
-			 * a selection. */
+			 * a selection.  Spring the nearest input to the center
+			 * of the display. */
+			deadline_due = 0;
 			state = S_SELECTED;
-			last_ticks = my_ticks;
-		}
-		else if ((state == S_SELECTED)) {
-			if ((pos <= (inputs[input].center + 1))
-			    && (pos >= (inputs[input].center - 1))) {
-				/* Move on to S_CENTERED if the nearest input
-				 * is centered in the display. */
-				pos = inputs[input].center;
-				state = S_CENTERED;
-				eeprom_update_word(EEPROM_POS_ADDRESS, pos);
-				last_ticks = my_ticks;
-			}
-			else if ((my_ticks - last_ticks) >= 40) {
-				/* Otherwise, automatically scroll left or
-				 * right until the nearest input is centered in
-				 * the display. */
-				uint8_t diff = abs(pos - inputs[input].center);
-				if ((pos < 100) && (inputs[input].center >= (ribbon_width - 100))) {
-					pos -= diff / 3 + 1;
-				}
-				else if (pos < inputs[input].center) {
-					pos += diff / 3 + 1;
-				}
-				else {
-					pos -= diff / 3 + 1;
-				}
-				last_ticks = my_ticks;
-			}
+			motion_target = pgm_read_word(&input_centers[input]);
 		}
-		else if ((inputs[input].address == 0xff)
+		else if ((state == S_SELECTED) && motion_settled()) {
+			/* Move on to S_CENTERED once the nearest input is
+			 * centered in the display. */
+			motion_set(pgm_read_word(&input_centers[input]));
+			state = S_CENTERED;
+			eeprom_write_pos(pos);
+		}
+		else if ((pgm_read_byte(&inputs[input].bank) == MUX_NONE)
 		    && ((state == S_CENTERED))) {
 			/* If the info logo is centered, pause before
 			 * displaying the uptimes. */
 			state = S_WAITINFOSCROLL;
-			last_ticks = my_ticks;
+			deadline_set(my_ticks + STATE_DELAY);
 		}
-		else if ((state == S_WAITINFOSCROLL)
-		    && ((my_ticks - last_ticks) >= STATE_DELAY)) {
-			/* Time to display the uptimes. */
+		else if ((state == S_WAITINFOSCROLL) && deadline_due) {
+			/* Time to display the uptimes, from the top. */
 			state = S_INFOSCROLL;
-			last_ticks = my_ticks;
+			uptime_row = 0;
+			deadline_set(my_ticks + SCROLL_DELAY);
+		}
+		else if ((state == S_INFOSCROLL) && deadline_due) {
+			/* Time to scroll the uptimes. */
+			uptime_scroll(my_ticks);
+			display_invalid = 1;
 		}
 		else if (state == S_CENTERED) {
 			/* If another logo is cented, latch the corresponding
-			 * address onto the multiplexer address bus. */
-			if ((input >= 1) && (input < NUM_INPUTS))
-				PORTA = inputs[input].address;
-			else
-				PORTA = UNUSED_INPUT;
+			 * address onto its multiplexer bank. */
+			if (input != mux_input) {
+				cec_routing_change(mux_input, input);
+				mux_input = input;
+				mux_select(pgm_read_byte(&inputs[input].bank),
+				           pgm_read_byte(&inputs[input].address));
+			}
 
 			/* Dim the display after after the same logo has been
 			 * centered for a while. */
@@ -778,38 +2674,101 @@ main(void)
 				vfd_brightness(0x01);
 		}
 
-
-		/* In these states, only render the selected logo part of the
-		 * ribbon. */
-		blank = ((state == S_SELECTED)
-		         || (state == S_WAITINFOSCROLL)
-		         || (state == S_INFOSCROLL)
-		         || (state == S_CENTERED));
-		/* Blit the visible portion of the ribbon to the video buffer.
-		 * */
-		blit_ribbon(buf, edge0, edge1, blank);
-
-		if (state == S_INFOSCROLL) {
-			/* Scroll and blit the uptime buffer into a window of
-			 * the video buffer. */
-			uint8_t tline = 0;
-			uint8_t trow = 0;
-			if ((my_ticks - last_ticks) >= SCROLL_DELAY) {
-				last_ticks = my_ticks;
-				trow++;
-				if (trow >= 8) {
-					tline++;
-					trow = 0;
+		/* Redraw when anything shown has changed, but no sooner than
+		 * FRAME_INTERVAL ticks after the last frame.  While the ribbon
+		 * is moving, frames are timed even if the last interval didn't
+		 * move it a whole column, to keep the motion updated. */
+		if ((pos != frame_pos) || (state != frame_state))
+			display_invalid = 1;
+		if (frame_due && (display_invalid || motion_moving())) {
+			frame_due = 0;
+			frame_armed = 0;
+			frame_ticks = my_ticks;
+			if (display_invalid) {
+				display_invalid = 0;
+				/* How far the ribbon has moved since the
+				 * frame on the VFD, the short way round. */
+				shift = pos - frame_pos;
+				if (shift > (int16_t)(ribbon_width / 2))
+					shift -= ribbon_width;
+				else if (shift < -(int16_t)(ribbon_width / 2))
+					shift += ribbon_width;
+				frame_pos = pos;
+				frame_state = state;
+
+				/* Each frame starts with an empty video
+				 * buffer. */
+				render_start = prof_time();
+				memset(buf, 0, DISPLAY_WIDTH * DISPLAY_BYTES);
+
+				/* In these states, only render the selected
+				 * logo part of the ribbon. */
+				blank = ((state == S_SELECTED)
+				         || (state == S_WAITINFOSCROLL)
+				         || (state == S_INFOSCROLL)
+				         || (state == S_CENTERED));
+				/* Blit the visible portion of the ribbon to
+				 * the video buffer. */
+				hal_mark(MARK_BLIT_RIBBON);
+				blit_ticks = prof_time();
+				blit_ribbon(buf, edge0, edge1, blank);
+				blit_ticks = prof_time() - blit_ticks;
+				hal_mark(MARK_BLIT_RIBBON | MARK_END);
+
+				if (state == S_INFOSCROLL) {
+					/* Blit the uptime buffer into a window
+					 * of the video buffer, 2 columns in
+					 * from the Info logo's left edge. */
+					render_uptime_window(utbuf, uptimes,
+					                     uptime_row);
+					blit_ticks -= prof_time();
+					window = edge0 - pos + DISPLAY_WIDTH / 2
+					         + 2;
+					blit_uptime(&buf[window * DISPLAY_BYTES],
+					            utbuf, uptime_row);
+					blit_ticks += prof_time();
 				}
-				if (tline >= (2 * (NUM_INPUTS) + 2))
-					tline = 0;
+				prof_record(PROF_RENDER, prof_time() - render_start);
+				prof_record(PROF_BLIT, blit_ticks);
+
+				/* Wait for the previous frame to finish going
+				 * out, then queue whatever changed in the
+				 * video buffer to the VFD!  The new frame is
+				 * sent while the next one is rendered into the
+				 * other buffer. */
+				vfd_wait_idle();
+				if ((int32_t)(prof_push_end - prof_push_start) > 0)
+					prof_record(PROF_SPI,
+					            prof_push_end - prof_push_start);
+				prof_push_start = prof_time();
+				prof_frames++;
+				hal_mark(MARK_FRAME_PUSH);
+				vfd_update(buf, shown, shift);
+				shown = buf;
+				buf = (buf == frames[0])
+				      ? frames[1] : frames[0];
 			}
-			blit_uptime(buf, utbuf, edge0, edge1, tline, trow);
+		}
+		/* After a long enough idle, frame_ticks + FRAME_INTERVAL is
+		 * half the timer's range or more behind and would look like
+		 * the future, so a frame that's already due is flagged
+		 * straight away rather than by the timer. */
+		if (!frame_due && !frame_armed
+		    && (display_invalid || motion_moving())) {
+			if ((uint16_t)(my_ticks - frame_ticks) >= FRAME_INTERVAL)
+				frame_due = 1;
+			else
+				frame_set(frame_ticks + FRAME_INTERVAL);
+			frame_armed = 1;
 		}
 
-		/* Write out the video buffer to the VFD! */
-		vfd_write_bit_image(0, 0, 140, 32, buf);
+		/* Sleep until an interrupt brings something to do. */
+		cli();
+		if ((enc_tail == enc_head) && !deadline_due && !uptimes_dirty
+		    && !power_failing && !cec_rx_ready
+		    && !(frame_due && (display_invalid || motion_moving())))
+			hal_sleep();
+		sei();
 	}
 	return 0;
 }
-
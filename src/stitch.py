@@ -1,114 +1,383 @@
-#!/usr/bin/env python
+#!/usr/bin/env python3
 """Generate a header with logo bitmap data and information about each input.
 Inputs are configured in the _INPUTS list below.
+
+    stitch.py [-o ribbon.h]
+
+With -o, the header is only rewritten if a hash of this script and the logos
+it uses has changed, so that make doesn't rebuild anything for an unchanged
+ribbon.  The hash is kept in the header's first comment.
+
+    stitch.py --font DIR [-o font.h]
+
+generates the uptime font instead, from PNGs of each of _FONT_CHARS in DIR as
+rendered by font_tools/renderpng.sh.
+
+    stitch.py --display PROFILE [-o display.h]
+
+generates the header with the VFD's geometry, for one of the panels in
+_DISPLAYS.
 """
+import argparse
+import contextlib
+import hashlib
+import io
 import os
+import sys
 import collections
+import numpy as np
 from PIL import Image
 
-Input = collections.namedtuple('Input', ['name', 'address', 'label', 'key'])
+Input = collections.namedtuple('Input',
+                               ['name', 'bank', 'address', 'label', 'key',
+                                'cec'])
 # name: Name of png file under logos/ to use for input logo
-# address: Multiplexer address for input
+# bank: Multiplexer board the input is on, counting from 0, or None for info,
+#       which isn't routed anywhere
+# address: Multiplexer address for input within its bank
 # label: 8-character label for input, used in uptime display
-# key: "Primary key" for input, used to index uptimes, so should never change
+# key: "Primary key" for input, used to index uptimes, so should never change.
+#      The keys must run from 0 to the number of inputs - 1.
+# cec: HDMI-CEC physical address that selects the input, as 'a.b.c.d', or
+#      None.  A device announcing itself as the active source, or the TV
+#      routing to it, from that address or any below it switches to the input.
+#
+# Each bank has its own address lines and enable line, see hal_mux_write() and
+# hal_mux_enable() for the pins.
+
+# Physical address of the HDMI input the switch's output ends up on, where
+# routing to the switch itself starts.
+_CEC_ADDRESS = '1.0.0.0'
 
 _INPUTS = [
-    Input('info', '0xFF', 'UPTIME', 0),
-    Input('genesis', '0x15', 'GENESIS', 1),
-    Input('superfamicom', '0x14', 'SFC', 2),
-    Input('threedo', '0x13', '3DO', 3),
-    Input('saturn', '0x12', 'SATURN', 4),
-    Input('playstation', '0x11', 'PSX', 5),
-    Input('dreamcast', '0x10', 'DC', 6),
-    Input('ps2', '0x0D', 'PS2', 7),
-    Input('gamecube', '0x0C', 'GAMECUBE', 8),
-    Input(None, '0x08', None, None),
-    Input(None, '0x09', None, None),
-    Input('vhs', '0x0A', 'VHS', 9),
-    Input('aux', '0x0B', 'AUX', 10),
+    Input('info', None, None, 'UPTIME', 0, None),
+    Input('genesis', 0, '0x15', 'GENESIS', 1, '1.1.0.0'),
+    Input('superfamicom', 0, '0x14', 'SFC', 2, '1.2.0.0'),
+    Input('threedo', 0, '0x13', '3DO', 3, '1.3.0.0'),
+    Input('saturn', 0, '0x12', 'SATURN', 4, '1.4.0.0'),
+    Input('playstation', 0, '0x11', 'PSX', 5, '1.5.0.0'),
+    Input('dreamcast', 0, '0x10', 'DC', 6, '1.6.0.0'),
+    Input('ps2', 0, '0x0D', 'PS2', 7, '1.7.0.0'),
+    Input('gamecube', 0, '0x0C', 'GAMECUBE', 8, '1.8.0.0'),
+    Input(None, 0, '0x08', None, None, None),
+    Input(None, 0, '0x09', None, None, None),
+    Input('vhs', 0, '0x0A', 'VHS', 9, '1.9.0.0'),
+    Input('aux', 0, '0x0B', 'AUX', 10, '1.A.0.0'),
 ]
 
-def main():
+Display = collections.namedtuple('Display',
+                                 ['width', 'height', 'memory_width'])
+# width, height: Visible pixels.  The height must be a multiple of 8, and
+#                main.c needs at least _RIBBON_HEIGHT.
+# memory_width: Columns of display memory, which the visible area scrolls
+#               through.
+
+_DISPLAYS = {
+    '140x32': Display(140, 32, 512),
+    '256x64': Display(256, 64, 512),
+}
+
+# Height of the ribbon, and so of the logos.  The compressed format holds
+# columns of up to 32 rows.  The ribbon is centered on taller displays.
+_RIBBON_HEIGHT = 32
+
+# Characters in the font, in order.  glyph_index in main.c maps characters
+# to them.
+_FONT_CHARS = '0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZdhms'
+
+# Columns per block of the compressed ribbon, as a power of 2.
+_RIBBON_BLOCK_SHIFT = 4
+
+# Columns per block of the input lookup table, as a power of 2.  No input may
+# be narrower than a block, so that at most one input starts inside each.
+_INPUT_BLOCK_SHIFT = 3
+
+def compress_ribbon(columns):
+    """Compress a list of columns of up to 4 bytes.  Returns a list with the
+    offset of each block of 1 << _RIBBON_BLOCK_SHIFT columns, and the
+    compressed data.  Each run of identical columns becomes a header byte
+    followed by the column's non-zero bytes.  The header's high nibble is the
+    run length minus one, and its low nibble has a bit set for each byte that
+    follows, bit 3 for the top byte.  Runs don't cross block boundaries so
+    that decoding can start at any block."""
+    block = 1 << _RIBBON_BLOCK_SHIFT
+    index = []
+    data = []
+    for start in range(0, len(columns), block):
+        index.append(len(data))
+        end = min(start + block, len(columns))
+        x = start
+        while x < end:
+            run = 1
+            while (x + run < end) and (columns[x + run] == columns[x]):
+                run += 1
+            mask = 0
+            for y, pix in enumerate(columns[x]):
+                if pix:
+                    mask |= 0x08 >> y
+            data.append(((run - 1) << 4) | mask)
+            data.extend(pix for pix in columns[x] if pix)
+            x += run
+    return index, data
+
+def cec_address(address):
+    """Pack a physical address, 'a.b.c.d', into a 16-bit word, a nibble
+    each.  None is 0xFFFF, which isn't a valid address."""
+    if address is None:
+        return 0xFFFF
+    nibbles = [int(n, 16) for n in address.split('.')]
+    if (len(nibbles) != 4) or (max(nibbles) > 15):
+        sys.exit('stitch.py: bad CEC physical address ' + address)
+    return (nibbles[0] << 12) | (nibbles[1] << 8) | (nibbles[2] << 4) \
+        | nibbles[3]
+
+def pack_columns(pixels):
+    """Pack an array of lit pixels, a multiple of 8 rows high, into the VFD's
+    format: column-major, each byte 8 consecutive vertical pixels with the
+    top one in the high bit.  Returns an array with a row of bytes for each
+    column."""
+    rows, width = pixels.shape
+    return np.packbits(pixels.reshape(rows // 8, 8, width),
+                       axis=1).reshape(rows // 8, width).T
+
+def load_logo(name):
+    """Load a logo as an array of lit pixels, those with full red."""
+    with open('logos/' + name + '.png', 'rb') as imagefile:
+        pixels = np.asarray(Image.open(imagefile).convert('RGBA'))
+    if pixels.shape[0] < _RIBBON_HEIGHT:
+        sys.exit('stitch.py: logos/{}.png must be {} pixels high'
+                 .format(name, _RIBBON_HEIGHT))
+    return pixels[:_RIBBON_HEIGHT, :, 0] == 255
+
+def assets_hash(paths, profile):
+    """Hash this script, which has the inputs and everything else that
+    decides the output, the display profile asked for and the files at
+    paths."""
+    digest = hashlib.sha1()
+    with open(os.path.abspath(__file__), 'rb') as script:
+        digest.update(script.read())
+    digest.update(profile.encode() + b'\0')
+    for path in paths:
+        digest.update(path.encode() + b'\0')
+        with open(path, 'rb') as f:
+            digest.update(f.read())
+    return digest.hexdigest()
+
+def ribbon_header(inputs, logos):
+    """Print ribbon.h for inputs, with logos holding each one's pixels."""
     total_width = 0
+    logo_widths = []
 
     print('#ifndef RIBBON_H')
     print('#define RIBBON_H')
 
     print('#include <stdint.h>')
 
+    banks = [i.bank for i in inputs if i.bank is not None]
+    print('#define NUM_INPUTS ' + str(len(inputs)))
+    print('#define MUX_BANKS ' + str(max(banks, default=-1) + 1))
+    print('#define MUX_NONE 0xff')
+    print('#define CEC_ADDRESS 0x{:04X}'.format(cec_address(_CEC_ADDRESS)))
+    print('#define CEC_NONE 0xFFFF')
+
+    # The inputs are only read a field at a time, so they stay in flash
+    # along with everything else here.
     print('struct input {')
+    print('\tuint8_t bank;')
     print('\tuint8_t address;')
     print('\tchar abbrev[9];')
-    print('\tuint16_t begin;')
-    print('\tuint16_t center;')
-    print('\tuint16_t end;')
     print('\tuint8_t id;')
-    print('} inputs[12] = {')
-    for i, input in enumerate(_INPUTS):
-        if input.name is not None:
-            print('\t{' + input.address + ', ', end='')
-            print('"' + input.label + '", ', end='')
-            # Loop through logos and calculate width info for each one.
-            # This is to determine the total width of the entire ribbon of
-            # logos, but it also the column indexes of the beginning, end, and
-            # middle of each logo within the ribbon.
-            with open('logos/' + input.name + '.png', 'rb') as imagefile:
-                image = Image.open(imagefile)
-                width, _ = image.size
-                print(str(total_width) + ', ', end='') # begin
-                print(str(total_width + int(width / 2)) + ', ', end='') # mid
-                total_width += width
-                total_width += 4
-                print(str(total_width) + ', ', end='') # end
-                print(str(input.key), end='') # key
-                print('},')
-    print('\t{0},')
+    print('\tuint16_t cec;')
+    print('};')
+    print('const struct input inputs[NUM_INPUTS] PROGMEM = {')
+    # Work out the total width of the entire ribbon of logos, and the
+    # column indexes of the edges and middle of each logo within the ribbon.
+    # Each input's edges are its first column and the first column of the
+    # next, so edges has one more entry than there are inputs.
+    edges = [0]
+    centers = []
+    for input, logo in zip(inputs, logos):
+        if input.bank is None:
+            print('\t{MUX_NONE, 0xFF, ', end='')
+        else:
+            print('\t{' + str(input.bank) + ', ' + input.address + ', ',
+                  end='')
+        print('"' + input.label + '", ', end='')
+        print(str(input.key) + ', ', end='') # key
+        print('0x{:04X}'.format(cec_address(input.cec)), end='')
+        print('},')
+        width = logo.shape[1]
+        centers.append(total_width + int(width / 2))
+        total_width += width
+        total_width += 4
+        logo_widths.append(width + 4)
+        edges.append(total_width)
     print('};')
 
-    ribbon = Image.new('RGBA', (total_width, 32))
-    ribbon_pixels = ribbon.load()
+    print('const uint16_t input_edges[NUM_INPUTS + 1] PROGMEM = {', end='')
+    print(','.join(str(e) for e in edges) + '};')
+    print('const uint16_t input_centers[NUM_INPUTS] PROGMEM = {', end='')
+    print(','.join(str(c) for c in centers) + '};')
 
-    # Current ribbon column
-    x0 = 0
+    # The input under the first column of each block of the ribbon.  The
+    # input under any column is then the block's input, or the one after it
+    # if the column is past the block input's right edge.
+    block = 1 << _INPUT_BLOCK_SHIFT
+    if min(logo_widths) < block:
+        sys.exit('stitch.py: logos must be at least {} columns wide'
+                 .format(block - 4))
+    blocks = []
+    i = 0
+    for x in range(0, total_width, block):
+        while x >= edges[i + 1]:
+            i += 1
+        blocks.append(i)
+    print('#define INPUT_BLOCK_SHIFT ' + str(_INPUT_BLOCK_SHIFT))
+    print('const uint8_t input_blocks[' + str(len(blocks)) + '] PROGMEM = {',
+          end='')
+    for n, i in enumerate(blocks):
+        if (n % 16) == 0:
+            print('')
+        print(str(i) + ',', end='')
+    print('')
+    print('};')
 
-    # Load each logo PNG into the ribbon image in sequence.
-    for input in _INPUTS:
-        if input.name is not None:
-            with open('logos/' + input.name + '.png', 'rb') as imagefile:
-                image = Image.open(imagefile)
-                width, _ = image.size
-                pixels = image.load()
-                # 2 column left margin
-                x0 += 2
-                for x in range(width):
-                    for y in range(32):
-                        ribbon_pixels[x0 + x, y] = pixels[x, y]
-                x0 += width
-                # 2 column right margin
-                x0 += 2
+    # Lay the logos out along the ribbon, each with a 2 column margin either
+    # side.
+    ribbon = np.zeros((_RIBBON_HEIGHT, total_width), dtype=bool)
+    x0 = 0
+    for logo in logos:
+        width = logo.shape[1]
+        ribbon[:, x0 + 2:x0 + 2 + width] = logo
+        x0 += width + 4
 
     # Spit out the ribbon image data.  The pixel data is in VFD format -
     # column-major order, each byte is 8 consecutive vertical pixels.
     print('const uint16_t ribbon_width = ' + str(total_width) + ';')
-    print('const uint8_t ribbon_height = ' + str(32) + ';')
-    num_inputs = len([i for i in _INPUTS if i[0] is not None])
-    print('#define NUM_INPUTS ' + str(num_inputs))
-    ribbon_size = total_width * int(32 / 8)
-    print('uint8_t ribbon_pixel[' + str(ribbon_size) + '] = {', end='')
-    for x in range(total_width):
-        if (x % 4) == 0:
+    print('#define RIBBON_HEIGHT ' + str(_RIBBON_HEIGHT))
+    print('#define RIBBON_BYTES ' + str(_RIBBON_HEIGHT // 8))
+    columns = [tuple(column) for column in pack_columns(ribbon).tolist()]
+
+    # The ribbon is stored compressed in flash so that it doesn't take up
+    # any SRAM.  See ribbon_decode() in main.c for the format.
+    index, data = compress_ribbon(columns)
+    print('#define RIBBON_BLOCK_SHIFT ' + str(_RIBBON_BLOCK_SHIFT))
+    print('#define RIBBON_LOGO_MAX ' + str(max(logo_widths)))
+    print('const uint16_t ribbon_index[' + str(len(index)) + '] PROGMEM = {',
+          end='')
+    for i, offset in enumerate(index):
+        if (i % 8) == 0:
             print('')
-        for y in range(int(32 / 8)):
-            pix = 0
-            for b in range(8):
-                r, _, _, a = ribbon_pixels[x, y * 8 + b]
-                if (r == 255):
-                    pix |= 1 << (7 - b)
-            print('0x{:02x},'.format(pix), end='')
+        print(str(offset) + ',', end='')
     print('')
     print('};')
+    print('const uint8_t ribbon_data[' + str(len(data)) + '] PROGMEM = {',
+          end='')
+    for i, pix in enumerate(data):
+        if (i % 16) == 0:
+            print('')
+        print('0x{:02x},'.format(pix), end='')
+    print('')
+    print('};')
+
+    ribbon_size = total_width * (_RIBBON_HEIGHT // 8)
+    compressed_size = 2 * len(index) + len(data)
+    sys.stderr.write('ribbon: {} bytes compressed to {} bytes ({:.2f}:1)\n'
+                     .format(ribbon_size, compressed_size,
+                             ribbon_size / compressed_size))
 
     print('#endif')
 
+def font_header(paths):
+    """Print font.h from the glyph PNGs at paths, in _FONT_CHARS order.  Each
+    glyph is 5 columns of the 8 rows below the top of its PNG, with black
+    ink."""
+    print('#ifndef FONT_H')
+    print('#define FONT_H')
+    print('')
+    print('const uint8_t font[' + str(len(paths)) + '][5] PROGMEM = {')
+    for path in paths:
+        with open(path, 'rb') as imagefile:
+            pixels = np.asarray(Image.open(imagefile).convert('L'))
+        glyph = pack_columns(pixels[1:9, 0:5] == 0)[:, 0]
+        print('\t{' + ''.join('0x{:02x},'.format(pix)
+                             for pix in glyph.tolist()) + '},')
+    print('};')
+    print('#endif')
+
+def display_header(name, display):
+    """Print display.h for display, the profile called name."""
+    print('#ifndef DISPLAY_H')
+    print('#define DISPLAY_H')
+    print('/* VFD geometry for the ' + name + ' profile, as constants so that')
+    print(' * the blitters are specialized for it. */')
+    print('#include <stdint.h>')
+    print('#define DISPLAY_WIDTH ' + str(display.width))
+    print('#define DISPLAY_HEIGHT ' + str(display.height))
+    print('/* Bytes in each column, 8 rows to a byte. */')
+    print('#define DISPLAY_BYTES ' + str(display.height // 8))
+    print('#define DISPLAY_MEMORY_WIDTH ' + str(display.memory_width))
+    print('/* Holds a column of the display, or a count of them. */')
+    if display.width < 256:
+        print('typedef uint8_t display_column_t;')
+    else:
+        print('typedef uint16_t display_column_t;')
+    print('#endif')
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Generate ribbon.h, font.h with --font, or display.h '
+                    'with --display.')
+    parser.add_argument('-o', dest='output',
+                        help='write to OUTPUT, only if the sources changed')
+    parser.add_argument('--font', metavar='DIR',
+                        help='generate the font from the PNGs in DIR')
+    parser.add_argument('--display', metavar='PROFILE',
+                        choices=sorted(_DISPLAYS),
+                        help='generate the display geometry for PROFILE, '
+                             'one of %(choices)s')
+    args = parser.parse_args()
+
+    if args.display is not None:
+        display = _DISPLAYS[args.display]
+        if display.height % 8:
+            sys.exit('stitch.py: display heights must be a multiple of 8')
+        paths = []
+    elif args.font is None:
+        inputs = [i for i in _INPUTS if i.name is not None]
+        if sorted(i.key for i in inputs) != list(range(len(inputs))):
+            sys.exit('stitch.py: input keys must run from 0 to {}'
+                     .format(len(inputs) - 1))
+        paths = ['logos/' + i.name + '.png' for i in inputs]
+    else:
+        paths = [os.path.join(args.font, c + '.png') for c in _FONT_CHARS]
+
+    # The hash goes in the first line, so it can be checked without
+    # reading the rest of a big header.
+    stamp = ('/* Generated by stitch.py, assets '
+             + assets_hash(paths, args.display or '') + ' */\n')
+    if args.output is not None:
+        with contextlib.suppress(OSError):
+            with open(args.output) as old:
+                if old.readline() == stamp:
+                    return
+
+    header = io.StringIO()
+    with contextlib.redirect_stdout(header):
+        if args.display is not None:
+            display_header(args.display, display)
+        elif args.font is None:
+            ribbon_header(inputs, [load_logo(i.name) for i in inputs])
+        else:
+            font_header(paths)
+    if args.output is None:
+        sys.stdout.write(stamp + header.getvalue())
+    else:
+        # Replace the header in one go, so a failed run never leaves half
+        # of one behind.
+        with open(args.output + '.tmp', 'w') as new:
+            new.write(stamp + header.getvalue())
+        os.replace(args.output + '.tmp', args.output)
+
 if __name__ == '__main__':
     main()